@@ -126,7 +126,7 @@ static void clear()
 /*
  * fcyc - Use K-best scheme to estimate the running time of function f
  */
-double fcyc(test_funct f, void *argp)
+double fcyc(test_funct f, test_funct setup, void *argp)
 {
     double result;
     init_sampler();
@@ -135,6 +135,8 @@ double fcyc(test_funct f, void *argp)
 	    double cyc;
 	    if (clear_cache)
 		clear();
+	    if (setup)
+		setup(argp);
 	    start_comp_counter();
 	    f(argp);
 	    cyc = get_comp_counter();
@@ -145,6 +147,8 @@ double fcyc(test_funct f, void *argp)
 	    double cyc;
 	    if (clear_cache)
 		clear();
+	    if (setup)
+		setup(argp);
 	    start_counter();
 	    f(argp);
 	    cyc = get_counter();
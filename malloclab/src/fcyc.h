@@ -10,8 +10,9 @@
 /* The test function takes a generic pointer as input */
 typedef void (*test_funct)(void *);
 
-/* Compute number of cycles used by test function f */
-double fcyc(test_funct f, void* argp);
+/* Compute number of cycles used by test function f; setup (may be
+   NULL) runs untimed before each sample */
+double fcyc(test_funct f, test_funct setup, void* argp);
 
 /*********************************************************
  * Set the various parameters used by measurement routines 
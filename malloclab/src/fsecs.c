@@ -40,17 +40,18 @@ void init_fsecs(void)
 }
 
 /*
- * fsecs - Return the running time of a function f (in seconds)
+ * fsecs - Return the running time of a function f (in seconds). If
+ *    setup is not NULL, setup(argp) runs untimed before each run of f.
  */
-double fsecs(fsecs_test_funct f, void *argp) 
+double fsecs(fsecs_test_funct f, fsecs_test_funct setup, void *argp) 
 {
 #if USE_FCYC
-    double cycles = fcyc(f, argp);
+    double cycles = fcyc(f, setup, argp);
     return cycles/(Mhz*1e6);
 #elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
+    return ftimer_itimer(f, setup, argp, 10);
 #elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
+    return ftimer_gettod(f, setup, argp, 10);
 #endif 
 }
 
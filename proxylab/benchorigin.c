@@ -0,0 +1,128 @@
+/*
+ * benchorigin.c - origin server for benchmarking the proxy on localhost.
+ *
+ * Any path of the form "/<bytes>/<name>" is answered with a 200 of exactly
+ * <bytes> body bytes and "Cache-Control: max-age=<-m>", so a load generator
+ * chooses object sizes in its URLs. "/nostore/<bytes>/<name>" is the same
+ * object sent with "Cache-Control: no-store", "/public/<bytes>/<name>"
+ * with "Cache-Control: public, max-age=<-m>". Every response waits -d
+ * milliseconds (plus up to -j of uniform jitter) before the header, to
+ * stand in for a distant origin. Connections are kept alive, one thread
+ * each, as a real origin behind the proxy's upstream pool would be.
+ *
+ * usage: benchorigin [-d delay ms] [-j jitter ms] [-m max-age] port
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#include "csapp.h"
+
+#define PATTERN_SIZE (64 * 1024)
+#define MAX_BODY (1ULL << 32)
+
+static char pattern[PATTERN_SIZE];	/* body bytes, written out repeatedly */
+static int delay_ms, jitter_ms;
+static int max_age = 3600;
+
+static void usage(void) {
+	fprintf(stderr, "usage: benchorigin [-d delay ms] [-j jitter ms] [-m max-age] port\n");
+	exit(1);
+}
+
+/* pause_response - the configured origin latency */
+static void pause_response(unsigned int *seed) {
+	int ms = delay_ms + (jitter_ms ? rand_r(seed) % (jitter_ms + 1) : 0);
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+
+	if (ms)
+		nanosleep(&ts, NULL);
+}
+
+/* respond - answer one request line; returns -1 if the connection must close */
+static int respond(int fd, char *uri, int keep_alive) {
+	char header[MAXLINE], cache_control[64];
+	unsigned long long size, left;
+	unsigned int n;
+	char *p = uri;
+
+	if (!strncmp(p, "/nostore/", 9)) {
+		strcpy(cache_control, "no-store");
+		p += 8;
+	}
+	else if (!strncmp(p, "/public/", 8)) {
+		sprintf(cache_control, "public, max-age=%d", max_age);
+		p += 7;
+	}
+	else
+		sprintf(cache_control, "max-age=%d", max_age);
+	if (*p != '/' || (size = strtoull(p + 1, &p, 10)) > MAX_BODY || *p != '/') {
+		sprintf(header, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n",
+			keep_alive ? "" : "Connection: close\r\n");
+		return rio_writen(fd, header, strlen(header)) == -1 ? -1 : 0;
+	}
+
+	sprintf(header, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+		"Content-Length: %llu\r\nCache-Control: %s\r\n%s\r\n",
+		size, cache_control, keep_alive ? "" : "Connection: close\r\n");
+	if (rio_writen(fd, header, strlen(header)) == -1)
+		return -1;
+	for (left = size; left > 0; left -= n) {
+		n = left < PATTERN_SIZE ? left : PATTERN_SIZE;
+		if (rio_writen(fd, pattern, n) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static void *serve(void *vargp) {
+	int fd = (int)(long)vargp, keep_alive;
+	unsigned int seed = fd;
+	char line[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	rio_t rio;
+
+	Pthread_detach(pthread_self());
+	Rio_readinitb(&rio, fd);
+	while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+		if (sscanf(line, "%s %s %s", method, uri, version) != 3)
+			break;
+		keep_alive = strcmp(version, "HTTP/1.0") != 0;
+		while (rio_readlineb(&rio, line, sizeof(line)) > 0 && strcmp(line, "\r\n") && strcmp(line, "\n"))
+			if (!strncasecmp(line, "Connection:", 11))
+				keep_alive = strcasestr(line + 11, "close") == NULL;
+		pause_response(&seed);
+		if (respond(fd, uri, keep_alive) == -1 || !keep_alive)
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int listenfd, fd, c, one = 1;
+	pthread_t tid;
+
+	while ((c = getopt(argc, argv, "d:j:m:")) != -1) {
+		switch (c) {
+		case 'd': delay_ms = atoi(optarg); break;
+		case 'j': jitter_ms = atoi(optarg); break;
+		case 'm': max_age = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || delay_ms < 0 || jitter_ms < 0)
+		usage();
+
+	memset(pattern, 'x', sizeof(pattern));
+	Signal(SIGPIPE, SIG_IGN);
+	listenfd = Open_listenfd(atoi(argv[optind]));
+	while (1) {
+		if ((fd = accept(listenfd, NULL, NULL)) < 0)
+			continue;
+		/* header and body are separate writes */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		Pthread_create(&tid, NULL, serve, (void *)(long)fd);
+	}
+	return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * bufpool.c - size-classed I/O buffers, recycled per thread.
+ *
+ * Buffers are carved out of slabs that are never unmapped. Each thread
+ * keeps a short free list per class and only takes the class lock to
+ * refill it from, or spill it into, the shared list. Past BUF_RETAIN
+ * bytes of free buffers in a class, the pages of those spilled are handed
+ * back to the kernel (they fault in again, zeroed, on reuse), so a burst
+ * of connections does not pin its peak memory. A response being
+ * copied for the cache grows as a BufChain a buffer at a time instead of
+ * sitting in a flat MAX_OBJECT_SIZE array for every request.
+ */
+#include "bufpool.h"
+
+#define CLASS_SIZE(c) (1U << (BUF_MIN_SHIFT + 2 * (c)))
+#define CHAIN_GROW_MAX (32 * 1024)	/* largest buffer a chain appends */
+#define THREAD_CAP(c) (BUF_THREAD_BYTES / CLASS_SIZE(c))	/* 0 for the largest class */
+
+static struct {
+	pthread_mutex_t lock;
+	Buf *free;
+	unsigned long nfree;
+} pool[BUF_CLASSES] = {
+	{PTHREAD_MUTEX_INITIALIZER, NULL, 0}, {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+	{PTHREAD_MUTEX_INITIALIZER, NULL, 0}, {PTHREAD_MUTEX_INITIALIZER, NULL, 0},
+};
+
+/* this thread's free buffers; threads here live as long as the process */
+static __thread Buf *local[BUF_CLASSES];
+static __thread int nlocal[BUF_CLASSES];
+
+/* stats */
+static unsigned long slabs;
+static unsigned long long slab_bytes;
+static unsigned long refills;
+static unsigned long spills;
+static unsigned long purged;		/* pages handed back */
+static unsigned long oversize;
+
+static void refill(int class);
+static void spill(int class);
+static void purge(Buf *b);
+
+/* refill - move half a thread's worth (at least one) of class buffers in, carving a slab if none are free */
+static void refill(int class) {
+	unsigned int stride = sizeof(Buf) + CLASS_SIZE(class), n, i;
+	char *slab;
+	Buf *b;
+
+	pthread_mutex_lock(&pool[class].lock);
+	if (!pool[class].free) {
+		n = BUF_SLAB / stride >= 4 ? BUF_SLAB / stride : 4;
+		slab = Malloc((size_t)n * stride);
+		for (i = 0; i < n; i++) {
+			b = (Buf *)(slab + (size_t)i * stride);
+			b->size = CLASS_SIZE(class);
+			b->class = class;
+			b->next = pool[class].free;
+			pool[class].free = b;
+		}
+		pool[class].nfree += n;
+		__atomic_add_fetch(&slabs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&slab_bytes, (unsigned long long)n * stride, __ATOMIC_RELAXED);
+	}
+	for (i = 0; (i == 0 || i < THREAD_CAP(class) / 2) && (b = pool[class].free); i++) {
+		pool[class].free = b->next;
+		pool[class].nfree--;
+		b->next = local[class];
+		local[class] = b;
+		nlocal[class]++;
+	}
+	__atomic_add_fetch(&refills, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool[class].lock);
+}
+
+/* spill - hand a thread's list back to the shared one, down to half its cap */
+static void spill(int class) {
+	Buf *b;
+	int i;
+
+	pthread_mutex_lock(&pool[class].lock);
+	for (i = nlocal[class]; i > THREAD_CAP(class) / 2; i--) {
+		b = local[class];
+		local[class] = b->next;
+		nlocal[class]--;
+		b->next = pool[class].free;
+		pool[class].free = b;
+		if (++pool[class].nfree * CLASS_SIZE(class) > BUF_RETAIN)
+			purge(b);
+	}
+	__atomic_add_fetch(&spills, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool[class].lock);
+}
+
+/* purge - release the whole pages inside b's data */
+static void purge(Buf *b) {
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long start = ((unsigned long)b->data + page - 1) & ~(page - 1);
+	unsigned long end = ((unsigned long)b->data + b->size) & ~(page - 1);
+
+	if (end > start && madvise((void *)start, end - start, MADV_DONTNEED) == 0)
+		__atomic_add_fetch(&purged, (end - start) / page, __ATOMIC_RELAXED);
+}
+
+/* buf_get - an empty buffer of at least size bytes */
+Buf *buf_get(unsigned int size) {
+	int class;
+	Buf *b;
+
+	for (class = 0; class < BUF_CLASSES && CLASS_SIZE(class) < size; class++)
+		;
+	if (class == BUF_CLASSES) {
+		b = Malloc(sizeof(Buf) + size);
+		b->size = size;
+		b->class = -1;
+		__atomic_add_fetch(&oversize, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		if (!local[class])
+			refill(class);
+		b = local[class];
+		local[class] = b->next;
+		nlocal[class]--;
+	}
+	b->next = NULL;
+	b->len = 0;
+	return b;
+}
+
+void buf_put(Buf *b) {
+	if (!b)
+		return;
+	if (b->class < 0) {
+		free(b);
+		return;
+	}
+	b->next = local[b->class];
+	local[b->class] = b;
+	if (++nlocal[b->class] > THREAD_CAP(b->class))
+		spill(b->class);
+}
+
+int bufpool_stats(char *buf, unsigned int size) {
+	unsigned long long free_bytes = 0;
+	int class;
+
+	for (class = 0; class < BUF_CLASSES; class++) {
+		pthread_mutex_lock(&pool[class].lock);
+		free_bytes += (unsigned long long)pool[class].nfree * CLASS_SIZE(class);
+		pthread_mutex_unlock(&pool[class].lock);
+	}
+	return snprintf(buf, size,
+		"bufpool_slabs: %lu\nbufpool_slab_bytes: %llu\nbufpool_shared_free_bytes: %llu\n"
+		"bufpool_refills: %lu\nbufpool_spills: %lu\nbufpool_purged_pages: %lu\nbufpool_oversize: %lu\n",
+		__atomic_load_n(&slabs, __ATOMIC_RELAXED), __atomic_load_n(&slab_bytes, __ATOMIC_RELAXED), free_bytes,
+		__atomic_load_n(&refills, __ATOMIC_RELAXED), __atomic_load_n(&spills, __ATOMIC_RELAXED),
+		__atomic_load_n(&purged, __ATOMIC_RELAXED),
+		__atomic_load_n(&oversize, __ATOMIC_RELAXED));
+}
+
+/* chain_append - copy len bytes to the end, each new buffer four times the last up to 32 KB */
+void chain_append(BufChain *c, char *data, unsigned int len) {
+	unsigned int n;
+	Buf *b;
+
+	c->len += len;
+	while (len > 0) {
+		if (!c->last || c->last->len == c->last->size) {
+			b = buf_get(!c->last ? CLASS_SIZE(0) :
+				c->last->size < CHAIN_GROW_MAX ? c->last->size * 4 : CHAIN_GROW_MAX);
+			if (c->last)
+				c->last->next = b;
+			else
+				c->first = b;
+			c->last = b;
+		}
+		b = c->last;
+		n = b->size - b->len < len ? b->size - b->len : len;
+		memcpy(b->data + b->len, data, n);
+		b->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * chain_pullup - make the first n bytes (or all, if fewer) contiguous in
+ * the first buffer and return them; NULL if the chain is empty.
+ */
+char *chain_pullup(BufChain *c, unsigned int n) {
+	Buf *b, *f;
+	unsigned int take;
+
+	if (n > c->len)
+		n = c->len;
+	if (!n)
+		return NULL;
+	if (c->first->len >= n)
+		return c->first->data;
+
+	b = buf_get(n);
+	while (b->len < n) {
+		f = c->first;
+		if (f->len <= b->size - b->len) {
+			/* whole buffers move over, even past n */
+			memcpy(b->data + b->len, f->data, f->len);
+			b->len += f->len;
+			c->first = f->next;
+			buf_put(f);
+			continue;
+		}
+		take = n - b->len;
+		memcpy(b->data + b->len, f->data, take);
+		memmove(f->data, f->data + take, f->len - take);
+		f->len -= take;
+		b->len += take;
+	}
+	b->next = c->first;
+	if (!c->first)
+		c->last = b;
+	c->first = b;
+	return b->data;
+}
+
+/* chain_insert - insert len bytes at offset at; -1 if at is past the end */
+int chain_insert(BufChain *c, unsigned int at, char *data, unsigned int len) {
+	unsigned int tail;
+	Buf *f, *b;
+
+	if (at > c->len)
+		return -1;
+	if (at == c->len) {
+		chain_append(c, data, len);
+		return 0;
+	}
+	for (f = c->first; at >= f->len; f = f->next)
+		at -= f->len;
+	tail = f->len - at;
+	if (f->size - f->len >= len) {
+		memmove(f->data + at + len, f->data + at, tail);
+		memcpy(f->data + at, data, len);
+		f->len += len;
+	}
+	else {
+		/* split f: the new bytes and its tail go into a buffer of their own */
+		b = buf_get(len + tail);
+		memcpy(b->data, data, len);
+		memcpy(b->data + len, f->data + at, tail);
+		b->len = len + tail;
+		f->len = at;
+		b->next = f->next;
+		f->next = b;
+		if (c->last == f)
+			c->last = b;
+	}
+	c->len += len;
+	return 0;
+}
+
+/* chain_iov - describe the chain's bytes in iov; -1 if it takes more than max entries */
+int chain_iov(BufChain *c, struct iovec *iov, int max) {
+	int n = 0;
+	Buf *b;
+
+	for (b = c->first; b; b = b->next) {
+		if (!b->len)
+			continue;
+		if (n == max)
+			return -1;
+		iov[n].iov_base = b->data;
+		iov[n].iov_len = b->len;
+		n++;
+	}
+	return n;
+}
+
+void chain_free(BufChain *c) {
+	Buf *b, *next;
+
+	for (b = c->first; b; b = next) {
+		next = b->next;
+		buf_put(b);
+	}
+	c->first = c->last = NULL;
+	c->len = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <sys/uio.h>
+
+#include "csapp.h"
+
+#define BUF_CLASSES 4			/* 2, 8, 32 and 128 KB */
+#define BUF_MIN_SHIFT 11		/* the smallest class is 1 << 11 bytes */
+#define BUF_SLAB (256 * 1024)	/* bytes carved into buffers at a time */
+#define BUF_THREAD_BYTES (32 * 1024)	/* free bytes a thread keeps per class */
+#define BUF_RETAIN (8 * 1024 * 1024)	/* free bytes per class kept resident */
+#define CHAIN_MAX_IOV 16		/* enough for any chain up to MAX_OBJECT_SIZE */
+
+/*
+ * An I/O buffer from the pool. The class is fixed by size; a request over
+ * the largest class gets a buffer of its own (class -1) that is freed
+ * instead of recycled.
+ */
+typedef struct Buf {
+	struct Buf *next;			/* in a free list or a chain */
+	unsigned int size;			/* capacity of data */
+	unsigned int len;			/* bytes used */
+	int class;
+	char data[];
+} Buf;
+
+/* bytes kept as a list of buffers that grows a buffer at a time; {0} is empty */
+typedef struct BufChain {
+	Buf *first;
+	Buf *last;
+	unsigned int len;			/* sum of the buffers' len */
+} BufChain;
+
+Buf *buf_get(unsigned int size);
+void buf_put(Buf *b);
+int bufpool_stats(char *buf, unsigned int size);
+
+void chain_append(BufChain *c, char *data, unsigned int len);
+char *chain_pullup(BufChain *c, unsigned int n);
+int chain_insert(BufChain *c, unsigned int at, char *data, unsigned int len);
+int chain_iov(BufChain *c, struct iovec *iov, int max);
+void chain_free(BufChain *c);
+
+#endif
@@ -1,12 +1,40 @@
 #include "cache.h"
 
-CacheList *cache_init(){
+static void table_insert(CacheShard *shard, CachedItem *node);
+static void table_delete(CacheShard *shard, CachedItem *node);
+static void table_grow(CacheShard *shard);
+static void link_node(CacheShard *shard, CachedItem *node);
+
+/*
+ * cache_init - nshards <= 0 picks CACHE_SHARDS. The count is capped so
+ * that every shard's share of MAX_CACHE_SIZE still fits one object.
+ * A NULL policy picks CLOCK; admission turns on the TinyLFU filter.
+ */
+CacheList *cache_init(int nshards, const CachePolicy *policy, int admission){
 	CacheList *list = Malloc(sizeof(CacheList));
-	list->head = NULL;
-	list->tail = NULL;
-	list->lock = Malloc(sizeof(*(list->lock)));
-	pthread_rwlock_init((list->lock), NULL);
-	list->bytes_left = MAX_CACHE_SIZE;
+	unsigned int i;
+
+	if(nshards <= 0)
+		nshards = CACHE_SHARDS;
+	if(nshards > MAX_CACHE_SIZE / MAX_OBJECT_SIZE)
+		nshards = MAX_CACHE_SIZE / MAX_OBJECT_SIZE;
+
+	list->nshards = nshards;
+	list->disk = NULL;
+	list->shards = Calloc(nshards, sizeof(CacheShard));
+	for(i = 0; i < list->nshards; i++) {
+		CacheShard *shard = &list->shards[i];
+		shard->hand = NULL;
+		shard->policy = policy ? policy : &clock_policy;
+		shard->sketch = admission ? Calloc(1, sizeof(Sketch)) : NULL;
+		shard->inflation = 0;
+		shard->rejected = 0;
+		pthread_rwlock_init(&shard->lock, NULL);
+		shard->bytes_left = MAX_CACHE_SIZE / nshards;
+		shard->table_size = MIN_TABLE_SIZE;
+		shard->table = Calloc(shard->table_size, sizeof(CachedItem *));
+		shard->count = 0;
+	}
 
 	return list;
 }
@@ -16,13 +44,20 @@ void init_node(CachedItem *node){
 		node->next = NULL;
 		node->prev = NULL;
 		node->length = 0;
+		node->index = NULL;
+		node->object = NULL;
+		node->referenced = 0;
+		node->freq = 0;
+		node->base = 0;
 	}
 }
 
 void set_node(CachedItem *node, char *index, unsigned int len){
 	if(node) {
-		node->index = Malloc(sizeof(char)*len);
-		memcpy(node->index, index,len);
+		unsigned int index_len = strlen(index) + 1;
+		node->index = Malloc(sizeof(char)*index_len);
+		memcpy(node->index, index, index_len);
+		node->hash = cache_hash(index);
 		node->length = len;
 	}
 }
@@ -31,142 +66,309 @@ void delete_node(CachedItem *node){
 	if(node){
 		if(node->index)
 			free(node->index);
-		if(node->content)
-			free(node->content);
+		if(node->object)
+			cache_release(node->object);
 		free(node);
 	}
 }
 
 void cache_destruct(CacheList *list) {
 	if(list) {
-		CachedItem *curr = list->head;
-		while(curr) {
-			CachedItem *tmp = curr;
-			curr = tmp->next;
-			delete_node(tmp);
+		unsigned int i;
+		for(i = 0; i < list->nshards; i++) {
+			CacheShard *shard = &list->shards[i];
+			while(shard->hand)
+				delete_node(evict_list(shard));
+			pthread_rwlock_destroy(&shard->lock);
+			free(shard->table);
+			free(shard->sketch);
 		}
-		pthread_rwlock_destroy((list->lock));
-		free(list->lock);
+		free(list->shards);
 		free(list);
 	}
 }
 
-CachedItem *search_node(CacheList *list, char *index) {
-	if(list) {
-		CachedItem *tmp = list->head;
-		while(tmp) {
-			if(!strcmp(tmp->index, index))
+/* 64-bit FNV-1a, finished with a murmur3 mix so the high bits vary too */
+unsigned long long cache_hash(char *index) {
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+
+	while(*index) {
+		hash ^= (unsigned char)*index++;
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/* get_shard - shards use the high hash bits, the tables the low ones */
+CacheShard *get_shard(CacheList *list, unsigned long long hash) {
+	return &list->shards[(hash >> 32) % list->nshards];
+}
+
+/*
+ * search_node - find index in the hash table. hash is cache_hash(index);
+ * the key string is only compared once the full 64-bit hash matches.
+ */
+CachedItem *search_node(CacheShard *shard, char *index, unsigned long long hash) {
+	if(shard) {
+		unsigned int mask = shard->table_size - 1;
+		unsigned int i = hash & mask;
+		CachedItem *tmp;
+
+		while((tmp = shard->table[i])) {
+			if(tmp->hash == hash && !strcmp(tmp->index, index))
 				return tmp;
-			tmp = tmp->next;
+			i = (i + 1) & mask;
 		}
 	}
 	return NULL;
 }
 
-void add_node(CachedItem *node, CacheList *list){
-	if(list) {
-		if(node){
-			while(list->bytes_left < node->length) {
-				CachedItem *tmp_node = evict_list(list);
-				delete_node(tmp_node);
+static void table_insert(CacheShard *shard, CachedItem *node) {
+	unsigned int mask, i;
+
+	if(2 * (shard->count + 1) > shard->table_size)
+		table_grow(shard);
+
+	mask = shard->table_size - 1;
+	i = node->hash & mask;
+	while(shard->table[i])
+		i = (i + 1) & mask;
+	shard->table[i] = node;
+	shard->count++;
+}
+
+/* table_delete - remove node, shifting later entries of its probe run back */
+static void table_delete(CacheShard *shard, CachedItem *node) {
+	unsigned int mask = shard->table_size - 1;
+	unsigned int i = node->hash & mask, j, k;
+
+	while(shard->table[i] != node)
+		i = (i + 1) & mask;
+	shard->table[i] = NULL;
+	shard->count--;
+
+	for(j = (i + 1) & mask; shard->table[j]; j = (j + 1) & mask) {
+		k = shard->table[j]->hash & mask;
+		/* move table[j] into the hole unless its home slot lies in (i, j] */
+		if((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			shard->table[i] = shard->table[j];
+			shard->table[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+static void table_grow(CacheShard *shard) {
+	CachedItem **old = shard->table;
+	unsigned int old_size = shard->table_size, i;
+
+	shard->table_size *= 2;
+	shard->table = Calloc(shard->table_size, sizeof(CachedItem *));
+	shard->count = 0;
+	for(i = 0; i < old_size; i++)
+		if(old[i])
+			table_insert(shard, old[i]);
+	free(old);
+}
+
+/* link_node - put node in the ring just behind the hand, i.e. where the sweep reaches it last */
+static void link_node(CacheShard *shard, CachedItem *node) {
+	if(!shard->hand) {
+		node->prev = node->next = node;
+		shard->hand = node;
+	}
+	else {
+		node->next = shard->hand;
+		node->prev = shard->hand->prev;
+		shard->hand->prev->next = node;
+		shard->hand->prev = node;
+	}
+	shard->bytes_left -= node->length;
+	table_insert(shard, node);
+}
+
+/*
+ * add_node - link node just behind the hand. An entry with the same index
+ * is replaced. The victims that make room are unlinked first; with
+ * admission on, node is refused and -1 returned if any of them is
+ * sketched as at least as frequent as node, and they all go back in front
+ * of the hand. Otherwise they are chained onto *evicted if given, else
+ * freed.
+ */
+int add_node(CachedItem *node, CacheShard *shard, CachedItem **evicted){
+	if(shard && node) {
+		CachedItem *old = search_node(shard, node->index, node->hash);
+		CachedItem *victims = NULL, *victim, *next;
+		int replace = (old != NULL), admit = 1;
+		unsigned int freq = 0;
+
+		if(replace)
+			delete_node(remove_node(old, shard));
+		if(shard->sketch) {
+			sketch_age(shard->sketch);
+			freq = sketch_estimate(shard->sketch, node->hash);
+		}
+		while(shard->bytes_left < node->length) {
+			victim = remove_node(shard->policy->victim(shard), shard);
+			victim->next = victims;
+			victims = victim;
+			if(shard->sketch && !replace && sketch_estimate(shard->sketch, victim->hash) >= freq) {
+				admit = 0;
+				break;
 			}
-			if(!list->tail) {
-				list->head = list->tail = node;
-				list->bytes_left -= node->length;
+		}
+		for(victim = victims; victim; victim = next) {
+			next = victim->next;
+			if(!admit) {
+				/* the last one taken goes back first, so the first ends up at the hand again */
+				link_node(shard, victim);
+				shard->hand = victim;
 			}
-			else {
-				list->tail->next = node;
-				node->prev = list->tail;
-				list->tail = node;
-				list->bytes_left -= node->length;
+			else if(evicted) {
+				victim->next = *evicted;
+				*evicted = victim;
 			}
+			else
+				delete_node(victim);
 		}
+		if(!admit) {
+			shard->rejected++;
+			return -1;
+		}
+		shard->policy->insert(shard, node);
+		link_node(shard, node);
+		return 0;
 	}
+	return -1;
 }
 
-CachedItem *remove_node(char *index, CacheList *list){
-	if(list){
-		CachedItem *tmp = search_node(list, index);
-		if(tmp) {
-			if(tmp == list->head)
-				tmp = evict_list(list);
-			else {
-				if(tmp->prev) 
-					tmp->prev->next = tmp->next;
-				if(tmp->next)
-					tmp->next->prev = tmp->prev;
-				else
-					list->tail = tmp->prev;
-				list->bytes_left += tmp->length;
-			}
-			tmp->prev = NULL;
-			tmp->next = NULL;
+CachedItem *remove_node(CachedItem *node, CacheShard *shard){
+	if(shard && node){
+		if(node->next == node)
+			shard->hand = NULL;
+		else {
+			if(shard->hand == node)
+				shard->hand = node->next;
+			node->prev->next = node->next;
+			node->next->prev = node->prev;
 		}
-		return tmp;
+		node->prev = NULL;
+		node->next = NULL;
+		table_delete(shard, node);
+		shard->bytes_left += node->length;
+		return node;
 	}
-	
+
 	return NULL;
 }
 
-/* LRU(least-recently-used) eviction */
-CachedItem *evict_list(CacheList *list){
-	if(list){
-		CachedItem *curr = list->head;
-		if(curr) {
-			if(curr->next)
-				curr->next->prev = NULL;
-			list->bytes_left += curr->length;
-			if(list->head == list->tail)
-				list->tail = NULL;
-			list->head = curr->next;
-			return curr;
-		}
-	}
+/* evict_list - unlink the policy's next victim */
+CachedItem *evict_list(CacheShard *shard){
+	if(shard && shard->hand)
+		return remove_node(shard->policy->victim(shard), shard);
 	return NULL;
 }
 
-int read_node_content(CacheList *list, char *index, char *content, unsigned int *len){
+/*
+ * cache_lookup - return a referenced object for index, or NULL on a miss.
+ * The shard's read lock is held only for the lookup and the reference
+ * count bump; the caller writes from object->data and then calls
+ * cache_release.
+ */
+CacheObject *cache_lookup(CacheList *list, char *index){
 	if(!list)
-		return -1;
+		return NULL;
 	
-	pthread_rwlock_rdlock((list->lock));
+	unsigned long long hash = cache_hash(index);
+	CacheShard *shard = get_shard(list, hash);
+	CacheObject *object = NULL;
 	
-	CachedItem *tmp = search_node(list, index);
+	pthread_rwlock_rdlock(&shard->lock);
 	
-	if(!tmp)
-	{
-		pthread_rwlock_unlock((list->lock));
-		return -1;
+	CachedItem *tmp = search_node(shard, index, hash);
+	
+	if(tmp) {
+		object = tmp->object;
+		__atomic_add_fetch(&object->refcnt, 1, __ATOMIC_RELAXED);
+		shard->policy->hit(shard, tmp);
 	}
+	/* hits and misses both count toward admission */
+	if(shard->sketch)
+		sketch_add(shard->sketch, hash);
 	
-	*len = tmp->length;
-	memcpy(content, tmp->content,*len);
+	pthread_rwlock_unlock(&shard->lock);
 	
-	pthread_rwlock_unlock((list->lock));
+	return object;
+}
+
+void cache_release(CacheObject *object){
+	if(object && __atomic_sub_fetch(&object->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		free(object);
+}
+
+/* cache_fresh - whether object may be served without asking the origin */
+int cache_fresh(CacheObject *object, time_t now){
+	time_t expires = __atomic_load_n(&object->expires, __ATOMIC_RELAXED);
 	
-	pthread_rwlock_wrlock((list->lock));
-	add_node(remove_node(index, list), list);
-	pthread_rwlock_unlock((list->lock));
+	return !expires || now < expires;
+}
+
+/* cache_refresh - a revalidation confirmed object; readers may race with this */
+void cache_refresh(CacheObject *object, time_t expires){
+	__atomic_store_n(&object->expires, expires, __ATOMIC_RELAXED);
+}
+
+int insert_content_node(CacheList *list, char *index, char *content, unsigned int len, time_t expires){
+	struct iovec iov = {content, len};
 	
-	return 0;
+	return insert_content_iov(list, index, &iov, 1, expires);
 }
 
-int insert_content_node(CacheList *list, char *index, char *content, unsigned int len){
+/* insert_content_iov - insert_content_node for content gathered from iov[0..iovcnt) */
+int insert_content_iov(CacheList *list, char *index, const struct iovec *iov, int iovcnt, time_t expires){
+	unsigned int len = 0, off = 0;
+	int i;
+	
 	if(!list)
 		return -1;
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 	
+	/* Malloc exits on failure */
 	CachedItem *tmp = Malloc(sizeof(*tmp));
 	init_node(tmp);
 	set_node(tmp, index, len);
 	
-	if(!tmp)
-		return -1;
-		
-	tmp->content = Malloc(sizeof(char)*len);
-	memcpy(tmp->content, content,len);
-
-	pthread_rwlock_wrlock((list->lock));
-	add_node(tmp, list);
-	pthread_rwlock_unlock((list->lock));
+	tmp->object = Malloc(sizeof(CacheObject) + len);
+	tmp->object->refcnt = 1;
+	tmp->object->length = len;
+	tmp->object->expires = expires;
+	for(i = 0; i < iovcnt; off += iov[i].iov_len, i++)
+		memcpy(tmp->object->data + off, iov[i].iov_base, iov[i].iov_len);
+	
+	CacheShard *shard = get_shard(list, tmp->hash);
+	CachedItem *evicted = NULL, *next;
+	pthread_rwlock_wrlock(&shard->lock);
+	if(add_node(tmp, shard, list->disk ? &evicted : NULL) == -1) {
+		/* not admitted; not an error */
+		if(list->disk) {
+			tmp->next = evicted;
+			evicted = tmp;
+		}
+		else
+			delete_node(tmp);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	
+	/* evicted and refused objects go to the disk tier outside the shard lock */
+	for(; evicted; evicted = next) {
+		next = evicted->next;
+		disk_put(list->disk, evicted->index, evicted->hash, evicted->object->data, evicted->object->length,
+			evicted->object->expires);
+		delete_node(evicted);
+	}
 	return 0;
 }
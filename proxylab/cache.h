@@ -1,40 +1,87 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <sys/uio.h>
+
 #include "csapp.h"
+#include "policy.h"
+#include "disk.h"
 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define MIN_TABLE_SIZE 256	/* initial hash table slots, a power of 2 */
+#define CACHE_SHARDS 8		/* default; each shard must fit MAX_OBJECT_SIZE */
+
+/*
+ * An object is immutable once cached, except for its expiry, which a
+ * successful revalidation moves forward. The cache holds one reference and
+ * every reader holding it from cache_lookup holds another; the last
+ * cache_release frees it, so eviction never pulls memory from under a
+ * reader.
+ */
+typedef struct CacheObject {
+	int refcnt;
+	unsigned int length;
+	time_t expires;		/* stale from then on; 0 never goes stale */
+	char data[];
+} CacheObject;
 
 typedef struct CachedItem {
 	char *index;
-	char *content;
+	CacheObject *object;
 	struct CachedItem *prev;
 	struct CachedItem *next;
 	unsigned int length;
+	unsigned long long hash;	/* cache_hash(index) */
+	int referenced;				/* CLOCK second-chance bit, set by hits */
+	unsigned int freq;			/* GDSF hit count */
+	unsigned long long base;	/* GDSF: shard inflation at the last hit */
 } CachedItem;
 
-typedef struct CacheList {
-	CachedItem *head;
-	CachedItem *tail;
-	pthread_rwlock_t *lock;
+/*
+ * One shard owns the keys whose hash selects it, a MAX_CACHE_SIZE/nshards
+ * byte budget and its own lock. Its entries form a circular list that the
+ * eviction policy sweeps with the hand.
+ */
+typedef struct CacheShard {
+	CachedItem *hand;
+	const CachePolicy *policy;
+	Sketch *sketch;			/* TinyLFU admission; NULL admits everything */
+	unsigned long long inflation;	/* GDSF L */
+	unsigned long rejected;	/* objects refused by admission */
+	pthread_rwlock_t lock;
 	unsigned int bytes_left;
+	CachedItem **table;		/* open addressing, linear probing */
+	unsigned int table_size;
+	unsigned int count;
+} CacheShard;
+
+typedef struct CacheList {
+	CacheShard *shards;
+	unsigned int nshards;
+	DiskCache *disk;		/* second tier for evicted objects, or NULL */
 } CacheList;
 
-CacheList *cache_init();
+CacheList *cache_init(int nshards, const CachePolicy *policy, int admission);
 void cache_destruct(CacheList *list);
 void init_node(CachedItem *node);
 
 void set_node(CachedItem *node, char *index, unsigned int len);
 void delete_node(CachedItem *node);
 
-CachedItem *search_node(CacheList *list, char *index);
-void add_node(CachedItem *node, CacheList *list);
-CachedItem *remove_node(char *index, CacheList *list);
-CachedItem *evict_list(CacheList *list);
+unsigned long long cache_hash(char *index);
+CacheShard *get_shard(CacheList *list, unsigned long long hash);
+CachedItem *search_node(CacheShard *shard, char *index, unsigned long long hash);
+int add_node(CachedItem *node, CacheShard *shard, CachedItem **evicted);
+CachedItem *remove_node(CachedItem *node, CacheShard *shard);
+CachedItem *evict_list(CacheShard *shard);
 
-int read_node_content(CacheList *list, char *index, char *content, unsigned int *len);
-int insert_content_node(CacheList *list, char *index, char *content, unsigned int len);
+CacheObject *cache_lookup(CacheList *list, char *index);
+void cache_release(CacheObject *object);
+int insert_content_node(CacheList *list, char *index, char *content, unsigned int len, time_t expires);
+int insert_content_iov(CacheList *list, char *index, const struct iovec *iov, int iovcnt, time_t expires);
+int cache_fresh(CacheObject *object, time_t now);
+void cache_refresh(CacheObject *object, time_t expires);
 
 
 #endif
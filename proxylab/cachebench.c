@@ -0,0 +1,129 @@
+/*
+ * cachebench.c - multi-threaded hit-rate and throughput benchmark for the
+ * proxy cache.
+ *
+ * Every thread looks up Zipf-distributed keys with cache_lookup and
+ * inserts the object on a miss, the way handle_client uses the cache.
+ *
+ * usage: cachebench [-t threads] [-n ops/thread] [-k keys] [-z skew]
+ *                   [-b object bytes] [-s shards] [-p policy] [-a]
+ */
+#include <getopt.h>
+#include <time.h>
+
+#include "cache.h"
+
+static CacheList *cache;
+static double *cdf;			/* cumulative Zipf probabilities of the keys */
+static int nkeys = 10000;
+static int nops = 1000000;
+static unsigned int obj_size = 2048;
+
+typedef struct {
+	unsigned int seed;
+	unsigned long hits;
+	unsigned long misses;
+} bench_arg;
+
+static void usage(void) {
+	fprintf(stderr, "usage: cachebench [-t threads] [-n ops/thread] [-k keys] [-z skew]\n");
+	fprintf(stderr, "                  [-b object bytes] [-s shards] [-p clock|gdsf] [-a]\n");
+	exit(1);
+}
+
+static int pick_key(unsigned int *seed) {
+	double u = (double)rand_r(seed) / ((double)RAND_MAX + 1);
+	int lo = 0, hi = nkeys - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void *bench_thread(void *vargp) {
+	bench_arg *arg = vargp;
+	char index[MAXLINE];
+	char *content = Malloc(MAX_OBJECT_SIZE);
+	CacheObject *object;
+	int i;
+
+	memset(content, 'x', obj_size);
+	for (i = 0; i < nops; i++) {
+		sprintf(index, "www.example.com:80/static/%d.png", pick_key(&arg->seed));
+		if ((object = cache_lookup(cache, index)) != NULL) {
+			arg->hits++;
+			cache_release(object);
+		}
+		else {
+			arg->misses++;
+			insert_content_node(cache, index, content, obj_size, 0);
+		}
+	}
+	free(content);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int nthreads = 4, shards = 0, admission = 0, c, i;
+	const CachePolicy *policy = &clock_policy;
+	double skew = 0.99, sum = 0, secs;
+	unsigned long hits = 0, misses = 0;
+	struct timespec start, end;
+	pthread_t *tids;
+	bench_arg *args;
+
+	while ((c = getopt(argc, argv, "t:n:k:z:b:s:p:a")) != -1) {
+		switch (c) {
+		case 't': nthreads = atoi(optarg); break;
+		case 'n': nops = atoi(optarg); break;
+		case 'k': nkeys = atoi(optarg); break;
+		case 'z': skew = atof(optarg); break;
+		case 'b': obj_size = atoi(optarg); break;
+		case 's': shards = atoi(optarg); break;
+		case 'p': if (!(policy = find_policy(optarg))) usage(); break;
+		case 'a': admission = 1; break;
+		default: usage();
+		}
+	}
+	if (nthreads <= 0 || nops <= 0 || nkeys <= 0 || !obj_size || obj_size > MAX_OBJECT_SIZE)
+		usage();
+
+	cdf = Malloc(nkeys * sizeof(double));
+	for (i = 0; i < nkeys; i++)
+		cdf[i] = sum += 1.0 / pow(i + 1, skew);
+	for (i = 0; i < nkeys; i++)
+		cdf[i] /= sum;
+
+	cache = cache_init(shards, policy, admission);
+	tids = Malloc(nthreads * sizeof(pthread_t));
+	args = Calloc(nthreads, sizeof(bench_arg));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++) {
+		args[i].seed = i + 1;
+		Pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		Pthread_join(tids[i], NULL);
+		hits += args[i].hits;
+		misses += args[i].misses;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("threads %d  shards %u  keys %d  skew %.2f  object %u bytes  %s%s\n",
+		nthreads, cache->nshards, nkeys, skew, obj_size, policy->name, admission ? "+tinylfu" : "");
+	printf("hit rate %.2f%%  %.0f Kops/s\n",
+		100.0 * hits / (hits + misses), (hits + misses) / secs / 1000);
+
+	cache_destruct(cache);
+	free(cdf);
+	free(tids);
+	free(args);
+	return 0;
+}
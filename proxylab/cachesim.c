@@ -0,0 +1,214 @@
+/*
+ * cachesim.c - trace-driven cache simulator. Replays a request log
+ * through the proxy cache under every eviction policy, with and without
+ * TinyLFU admission, and reports object and byte hit ratios.
+ *
+ * A trace has one request per line, "<cache index> <bytes>"; anything
+ * after the size is ignored. A miss inserts the object if it fits
+ * MAX_OBJECT_SIZE, as the proxy does. Without a trace file a synthetic
+ * one is generated: Zipf-popular objects with log-normal sizes,
+ * interleaved with scans of large objects that are requested once.
+ *
+ * With -d the disk tier is added in <dir> (-D MB, default 64) and its hits
+ * count as hits; the directory is emptied between runs.
+ *
+ * usage: cachesim [-s shards] [-d dir [-D MB]] [trace]
+ *        cachesim [-s shards] [-d dir [-D MB]] [-n requests] [-k keys] [-z skew] [-S scan%]
+ */
+#include <getopt.h>
+#include <dirent.h>
+
+#include "cache.h"
+
+typedef struct {
+	char *index;
+	unsigned int size;
+} request_t;
+
+static request_t *reqs;
+static int nreqs;
+static char *disk_dir;
+static unsigned long long disk_size = 64;
+
+static void usage(void) {
+	fprintf(stderr, "usage: cachesim [-s shards] [-d dir [-D MB]] [trace]\n");
+	fprintf(stderr, "       cachesim [-s shards] [-d dir [-D MB]] [-n requests] [-k keys] [-z skew] [-S scan%%]\n");
+	exit(1);
+}
+
+static void add_request(char *index, unsigned int size) {
+	static int alloc;
+
+	if (nreqs == alloc) {
+		alloc = alloc ? 2 * alloc : 4096;
+		reqs = Realloc(reqs, alloc * sizeof(request_t));
+	}
+	reqs[nreqs].index = strdup(index);
+	reqs[nreqs].size = size;
+	nreqs++;
+}
+
+static void load_trace(char *path) {
+	char line[MAXLINE], index[MAXLINE];
+	unsigned int size;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r"))) {
+		fprintf(stderr, "cannot read %s\n", path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "%s %u", index, &size) == 2)
+			add_request(index, size);
+	fclose(fp);
+}
+
+static double uniform(unsigned int *seed) {
+	return ((double)rand_r(seed) + 1) / ((double)RAND_MAX + 2);
+}
+
+/* log-normal object size around a median of 4 KB, a few above MAX_OBJECT_SIZE */
+static unsigned int object_size(int key) {
+	unsigned int seed = key * 2654435761u + 1;
+	double n = sqrt(-2 * log(uniform(&seed))) * cos(2 * M_PI * uniform(&seed));
+
+	return (unsigned int)(4096 * exp(1.3 * n)) + 64;
+}
+
+static void synthesize(int n, int nkeys, double skew, int scan_pct) {
+	char index[MAXLINE];
+	double *cdf = Malloc(nkeys * sizeof(double)), sum = 0, u;
+	unsigned int seed = 1;
+	int i, lo, hi, mid, scan = 0, burst = 0;
+
+	for (i = 0; i < nkeys; i++)
+		cdf[i] = sum += 1.0 / pow(i + 1, skew);
+	for (i = 0; i < nkeys; i++)
+		cdf[i] /= sum;
+
+	for (i = 0; i < n; i++) {
+		/* scans come in bursts of 50 distinct large objects */
+		if (!burst && rand_r(&seed) % 5000 < scan_pct)
+			burst = 50;
+		if (burst) {
+			burst--;
+			sprintf(index, "scan.example.com:80/archive/%d.bin", scan++);
+			add_request(index, 40000 + rand_r(&seed) % 60000);
+			continue;
+		}
+		u = uniform(&seed);
+		for (lo = 0, hi = nkeys - 1; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		sprintf(index, "www.example.com:80/static/%d", lo);
+		add_request(index, object_size(lo));
+	}
+	free(cdf);
+}
+
+/* remove_segments - start every run with an empty disk tier */
+static void remove_segments(void) {
+	char path[MAXLINE];
+	struct dirent *de;
+	DIR *d;
+
+	if (!(d = opendir(disk_dir)))
+		return;
+	while ((de = readdir(d)) != NULL)
+		if (strstr(de->d_name, ".seg")) {
+			snprintf(path, sizeof(path), "%s/%s", disk_dir, de->d_name);
+			unlink(path);
+		}
+	closedir(d);
+}
+
+static void replay(const CachePolicy *policy, int admission, int shards, char *content) {
+	CacheList *cache = cache_init(shards, policy, admission);
+	unsigned long hits = 0, hit_bytes = 0, bytes = 0, rejected = 0, disk_hits = 0;
+	CacheObject *object;
+	DiskCache disk;
+	DiskRef ref;
+	unsigned int i;
+
+	if (disk_dir) {
+		remove_segments();
+		if (disk_init(&disk, disk_dir, disk_size << 20) == -1) {
+			fprintf(stderr, "cannot use %s\n", disk_dir);
+			exit(1);
+		}
+		cache->disk = &disk;
+	}
+
+	for (i = 0; i < nreqs; i++) {
+		bytes += reqs[i].size;
+		if ((object = cache_lookup(cache, reqs[i].index)) != NULL) {
+			hits++;
+			hit_bytes += reqs[i].size;
+			cache_release(object);
+		}
+		else if (cache->disk && disk_lookup(&disk, reqs[i].index, cache_hash(reqs[i].index), &ref) == 0) {
+			hits++;
+			disk_hits++;
+			hit_bytes += reqs[i].size;
+			insert_content_node(cache, reqs[i].index, ref.data, ref.length, ref.expires);
+			disk_release(&disk, &ref);
+		}
+		else if (reqs[i].size <= MAX_OBJECT_SIZE)
+			insert_content_node(cache, reqs[i].index, content, reqs[i].size, 0);
+	}
+	for (i = 0; i < cache->nshards; i++)
+		rejected += cache->shards[i].rejected;
+
+	printf("%-6s %-8s %8.2f%% %8.2f%% %10lu", policy->name, admission ? "tinylfu" : "all",
+		100.0 * hits / nreqs, 100.0 * hit_bytes / bytes, rejected);
+	if (disk_dir)
+		printf(" %8.2f%%", 100.0 * disk_hits / nreqs);
+	printf("\n");
+	cache_destruct(cache);
+	if (disk_dir)
+		disk_destruct(&disk);
+}
+
+int main(int argc, char **argv) {
+	const CachePolicy *policies[] = {&clock_policy, &gdsf_policy, NULL};
+	int n = 1000000, nkeys = 20000, scan_pct = 5, shards = 0, c, i;
+	double skew = 0.9;
+	char *content;
+
+	while ((c = getopt(argc, argv, "s:n:k:z:S:d:D:")) != -1) {
+		switch (c) {
+		case 's': shards = atoi(optarg); break;
+		case 'n': n = atoi(optarg); break;
+		case 'k': nkeys = atoi(optarg); break;
+		case 'z': skew = atof(optarg); break;
+		case 'S': scan_pct = atoi(optarg); break;
+		case 'd': disk_dir = optarg; break;
+		case 'D': disk_size = strtoull(optarg, NULL, 10); break;
+		default: usage();
+		}
+	}
+	if (n <= 0 || nkeys <= 0 || scan_pct < 0 || optind < argc - 1)
+		usage();
+
+	if (optind < argc)
+		load_trace(argv[optind]);
+	else
+		synthesize(n, nkeys, skew, scan_pct);
+	if (!nreqs)
+		usage();
+
+	content = Calloc(1, MAX_OBJECT_SIZE);
+	printf("%d requests, cache %d bytes\n", nreqs, MAX_CACHE_SIZE);
+	printf("%-6s %-8s %9s %9s %10s%s\n", "policy", "admit", "obj hit", "byte hit", "rejected",
+		disk_dir ? "  disk hit" : "");
+	for (i = 0; policies[i]; i++) {
+		replay(policies[i], 0, shards, content);
+		replay(policies[i], 1, shards, content);
+	}
+	free(content);
+	return 0;
+}
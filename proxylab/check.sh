@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# check.sh - end-to-end checks of the proxy against benchorigin on
+# localhost, in both modes. Run by "make check".
+#
+# usage: check.sh [base port]
+
+BASE=${1:-$((20000 + $$ % 20000))}
+ORIGIN=$BASE
+fail=0
+
+# stat <proxy port> <name> - a counter from the proxy's /__stats page
+stat() {
+	curl -s --max-time 5 "http://127.0.0.1:$1/__stats" | sed -n "s/^$2: //p"
+}
+
+# fetch <proxy port> <path> [curl args] - GET through the proxy, body discarded
+fetch() {
+	local port=$1 path=$2
+	shift 2
+	curl -s --max-time 5 -o /dev/null -x "http://127.0.0.1:$port" "$@" "http://127.0.0.1:$ORIGIN$path"
+}
+
+# up <port> <path> - wait up to 5s for a server on port to answer
+up() {
+	local i
+	for i in $(seq 1 50); do
+		curl -s --max-time 1 -o /dev/null "http://127.0.0.1:$1$2" && return
+		sleep 0.1
+	done
+}
+
+# expect <what> <want> <got>
+expect() {
+	if [ "$2" != "$3" ]; then
+		echo "FAIL: $1: expected $2, got $3"
+		fail=1
+	fi
+}
+
+./benchorigin "$ORIGIN" > /dev/null 2>&1 &
+origin_pid=$!
+up $ORIGIN /1/up
+trap 'kill $origin_pid $proxy_pid 2> /dev/null' EXIT
+
+port=$BASE
+for mode in threads events; do
+	port=$((port + 1))
+	./proxy "$port" --mode=$mode > /dev/null 2>&1 &
+	proxy_pid=$!
+	up $port /__stats
+
+	# a response to credentials is not served to anyone else...
+	fetch $port /100/auth -H "Authorization: Basic dTpw"
+	fetch $port /100/auth
+	expect "$mode: anonymous request after Authorization" 0 "$(stat $port hits)"
+	fetch $port /100/cookie -H "Cookie: session=1"
+	fetch $port /100/cookie
+	expect "$mode: anonymous request after Cookie" 0 "$(stat $port hits)"
+
+	# ...unless Cache-Control marks it public
+	fetch $port /public/100/auth -H "Authorization: Basic dTpw"
+	fetch $port /public/100/auth
+	expect "$mode: anonymous request after public response" 1 "$(stat $port hits)"
+
+	kill $proxy_pid
+	wait $proxy_pid 2> /dev/null
+done
+
+# idle upstream connections stay under --upstream-max-idle, oldest closed first
+port=$((port + 1))
+./proxy "$port" --upstream-max-idle=1 > /dev/null 2>&1 &
+proxy_pid=$!
+up $port /__stats
+fetch $port /100/idle
+curl -s --max-time 5 -o /dev/null -x "http://127.0.0.1:$port" "http://localhost:$ORIGIN/100/idle"
+pool=$(curl -s --max-time 5 "http://127.0.0.1:$port/__pool")
+expect "idle upstream connections" 1 "$(echo "$pool" | sed -n 's/^upstream_idle: //p')"
+expect "evicted upstream connections" 1 "$(echo "$pool" | sed -n 's/^upstream_evicted: //p')"
+kill $proxy_pid
+wait $proxy_pid 2> /dev/null
+
+# an object promoted from the disk tier keeps the expiry it had in memory
+# (60 x 60KB overflows the memory cache)
+./benchorigin -m 4 "$((BASE + 4))" > /dev/null 2>&1 &
+origin2_pid=$!
+up $((BASE + 4)) /1/up
+trap 'kill $origin_pid $origin2_pid $proxy_pid 2> /dev/null; rm -rf "$disk_dir"' EXIT
+disk_dir=$(mktemp -d)
+port=$((BASE + 5))
+./proxy "$port" --disk-cache="$disk_dir" --disk-size=16 > /dev/null 2>&1 &
+proxy_pid=$!
+up $port /__stats
+fetch_all() {
+	for i in $(seq 1 60); do
+		curl -s --max-time 5 -o /dev/null -x "http://127.0.0.1:$port" "http://127.0.0.1:$((BASE + 4))/60000/$i"
+	done
+}
+fetch_all
+sleep 2.5
+fetch_all
+promoted=$(stat $port disk_hits)
+sleep 2
+fetch_all
+expect "disk hits after max-age" "$promoted" "$(stat $port disk_hits)"
+kill $proxy_pid
+wait $proxy_pid 2> /dev/null
+
+[ $fail = 0 ] && echo "check: all passed"
+exit $fail
@@ -0,0 +1,298 @@
+/*
+ * collapse.c - collapsed forwarding. Concurrent misses for one cache index
+ * share a single upstream fetch: the first becomes the leader, the rest
+ * subscribe to its Pending entry and receive the response as it arrives.
+ *
+ * Followers only get a response whose head could be cached; anything else
+ * (no-store, private, an uncacheable status) turns them away to fetch on
+ * their own. Past MAX_OBJECT_SIZE the entry closes to new followers, and
+ * from then on the buffer only keeps what its slowest follower has yet to
+ * read: the leader waits for one that falls more than COLLAPSE_MAX_LAG
+ * behind, and cuts it off if it does not catch up.
+ *
+ * The table lock is per bucket and only covers finding, adding and
+ * removing entries; the leader's appends and its followers' reads take
+ * the entry's own lock, so fetches for different keys do not contend.
+ */
+#define _GNU_SOURCE
+#include "collapse.h"
+
+static unsigned int bucket(char *key);
+static void unlink_pending(CollapseTable *t, Pending *p);
+static int behind(Pending *p, unsigned int len);
+static void trim(Pending *p, unsigned int len);
+
+void collapse_init(CollapseTable *t) {
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	for (i = 0; i < COLLAPSE_BUCKETS; i++)
+		pthread_mutex_init(&t->locks[i], NULL);
+}
+
+static unsigned int bucket(char *key) {
+	unsigned int h = 5381;
+
+	while (*key)
+		h = h * 33 + (unsigned char)*key++;
+	return h % COLLAPSE_BUCKETS;
+}
+
+static void unlink_pending(CollapseTable *t, Pending *p) {
+	unsigned int h = bucket(p->key);
+	Pending **pp;
+
+	pthread_mutex_lock(&t->locks[h]);
+	for (pp = &t->buckets[h]; *pp; pp = &(*pp)->next) {
+		if (*pp == p) {
+			*pp = p->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&t->locks[h]);
+}
+
+/*
+ * collapse_begin - register a miss for key. Returns a new entry with
+ * *leader set, an in-flight entry to follow through r, or NULL if the
+ * in-flight fetch can no longer be joined.
+ */
+Pending *collapse_begin(CollapseTable *t, char *key, int *leader, Reader *r) {
+	unsigned int h = bucket(key);
+	Pending *p;
+
+	pthread_mutex_lock(&t->locks[h]);
+	for (p = t->buckets[h]; p; p = p->next)
+		if (!strcmp(p->key, key))
+			break;
+
+	if (p) {
+		*leader = 0;
+		pthread_mutex_lock(&p->lock);
+		pthread_mutex_unlock(&t->locks[h]);
+		if (!p->open) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		p->refcnt++;
+		r->off = 0;
+		r->dropped = 0;
+		r->next = p->readers;
+		p->readers = r;
+		pthread_mutex_unlock(&p->lock);
+		__atomic_add_fetch(&t->followers, 1, __ATOMIC_RELAXED);
+		return p;
+	}
+
+	p = Calloc(1, sizeof(Pending));
+	p->key = strdup(key);
+	pthread_mutex_init(&p->lock, NULL);
+	p->refcnt = 1;
+	p->open = 1;
+	pthread_cond_init(&p->cond, NULL);
+	pthread_cond_init(&p->drained, NULL);
+	p->next = t->buckets[h];
+	t->buckets[h] = p;
+	pthread_mutex_unlock(&t->locks[h]);
+	__atomic_add_fetch(&t->leaders, 1, __ATOMIC_RELAXED);
+	*leader = 1;
+	return p;
+}
+
+/* behind - whether a follower would fall more than COLLAPSE_MAX_LAG behind after len more bytes */
+static int behind(Pending *p, unsigned int len) {
+	Reader *r;
+
+	for (r = p->readers; r; r = r->next)
+		if (p->len + len - r->off > COLLAPSE_MAX_LAG)
+			return 1;
+	return 0;
+}
+
+/*
+ * trim - make room for len more bytes on a closed entry. The leader waits
+ * up to COLLAPSE_LAG_WAIT seconds for followers that would fall more than
+ * COLLAPSE_MAX_LAG behind, cuts off any still behind, and drops what all
+ * the rest have read from the front of the buffer.
+ */
+static void trim(Pending *p, unsigned int len) {
+	unsigned long long low = p->len;
+	struct timespec deadline;
+	Reader *r, **rp;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += COLLAPSE_LAG_WAIT;
+	while (behind(p, len))
+		if (pthread_cond_timedwait(&p->drained, &p->lock, &deadline) == ETIMEDOUT)
+			break;
+
+	for (rp = &p->readers; (r = *rp); ) {
+		if (p->len + len - r->off > COLLAPSE_MAX_LAG) {
+			r->dropped = 1;
+			*rp = r->next;
+			continue;
+		}
+		if (r->off < low)
+			low = r->off;
+		rp = &r->next;
+	}
+	if (low > p->base) {
+		memmove(p->buf, p->buf + (low - p->base), p->len - low);
+		p->base = low;
+	}
+}
+
+void collapse_append(CollapseTable *t, Pending *p, char *data, unsigned int len) {
+	pthread_mutex_lock(&p->lock);
+	if (p->open && p->len + len > MAX_OBJECT_SIZE)
+		p->open = 0;
+	if (p->shared != -1 && (p->open || p->readers)) {
+		if (p->len - p->base + len > p->size) {
+			if (!p->open)
+				trim(p, len);
+			p->size = p->size ? p->size : MAXBUF;
+			while (p->len - p->base + len > p->size)
+				p->size *= 2;
+			p->buf = Realloc(p->buf, p->size);
+		}
+		memcpy(p->buf + (p->len - p->base), data, len);
+		p->len += len;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * collapse_share - the leader has the whole head; followers get the
+ * response only if ok, i.e. it could be cached. Otherwise they are turned
+ * away before sending anything, to fetch on their own.
+ */
+void collapse_share(CollapseTable *t, Pending *p, int ok) {
+	pthread_mutex_lock(&p->lock);
+	p->shared = ok ? 1 : -1;
+	if (!ok) {
+		p->open = 0;
+		free(p->buf);
+		p->buf = NULL;
+		p->size = 0;
+	}
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * collapse_wanted - whether the next more bytes must still be appended.
+ * With no followers, an entry that would outgrow MAX_OBJECT_SIZE is
+ * closed right away, so the leader can stop copying.
+ */
+int collapse_wanted(CollapseTable *t, Pending *p, unsigned long long more) {
+	int wanted;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->open && !p->readers && p->len + more > MAX_OBJECT_SIZE)
+		p->open = 0;
+	wanted = p->shared != -1 && (p->open || p->readers);
+	pthread_mutex_unlock(&p->lock);
+	return wanted;
+}
+
+/* collapse_end - the leader is done; later misses start a new fetch */
+void collapse_end(CollapseTable *t, Pending *p, int ok) {
+	unlink_pending(t, p);
+	pthread_mutex_lock(&p->lock);
+	p->done = ok ? 1 : -1;
+	p->open = 0;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	collapse_release(t, p);
+}
+
+/*
+ * collapse_head - wait for the leader to share the response header, copy
+ * it, blank line included, into dst and move r to that blank line, which
+ * the follower reads again after adding its own headers. Returns its
+ * length, 0 if no header end was seen within max bytes, or -1 if the
+ * response is not shared: the leader failed before producing a header,
+ * the header is not storable or r was cut off.
+ */
+int collapse_head(CollapseTable *t, Pending *p, Reader *r, char *dst, unsigned int max) {
+	char *end = NULL;
+	int head;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->shared && !p->done && !r->dropped)
+		pthread_cond_wait(&p->cond, &p->lock);
+	if (p->shared != 1 || r->dropped)
+		head = -1;
+	else {
+		/* nothing is trimmed before r, so the buffer still starts at byte 0 */
+		end = memmem(p->buf, p->len < max ? p->len : max, "\r\n\r\n", 4);
+		head = end ? end - p->buf + 4 : 0;
+		memcpy(dst, p->buf, head);
+		r->off = head ? head - 2 : 0;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return head;
+}
+
+/*
+ * collapse_read - copy up to max bytes from r's place and move it on,
+ * waiting for the leader if needed. Returns the byte count, 0 at the end
+ * of a complete response, or -1 if the leader failed or r was cut off.
+ */
+int collapse_read(CollapseTable *t, Pending *p, Reader *r, char *dst, unsigned int max) {
+	int n;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->len <= r->off && !p->done && !r->dropped)
+		pthread_cond_wait(&p->cond, &p->lock);
+	if (r->dropped)
+		n = -1;
+	else if (p->len > r->off) {
+		n = p->len - r->off < max ? p->len - r->off : max;
+		memcpy(dst, p->buf + (r->off - p->base), n);
+		r->off += n;
+		pthread_cond_signal(&p->drained);
+	}
+	else
+		n = (p->done == 1) ? 0 : -1;
+	pthread_mutex_unlock(&p->lock);
+	return n;
+}
+
+/* collapse_leave - a follower is done reading */
+void collapse_leave(CollapseTable *t, Pending *p, Reader *r) {
+	Reader **rp;
+
+	pthread_mutex_lock(&p->lock);
+	for (rp = &p->readers; *rp; rp = &(*rp)->next) {
+		if (*rp == r) {
+			*rp = r->next;
+			break;
+		}
+	}
+	pthread_cond_signal(&p->drained);
+	pthread_mutex_unlock(&p->lock);
+	collapse_release(t, p);
+}
+
+void collapse_release(CollapseTable *t, Pending *p) {
+	int last;
+
+	pthread_mutex_lock(&p->lock);
+	last = (--p->refcnt == 0);
+	pthread_mutex_unlock(&p->lock);
+	if (last) {
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->cond);
+		pthread_cond_destroy(&p->drained);
+		free(p->key);
+		free(p->buf);
+		free(p);
+	}
+}
+
+int collapse_stats(CollapseTable *t, char *buf, unsigned int size) {
+	return snprintf(buf, size, "collapse_leaders: %lu\ncollapse_followers: %lu\n",
+		__atomic_load_n(&t->leaders, __ATOMIC_RELAXED), __atomic_load_n(&t->followers, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,62 @@
+#ifndef __COLLAPSE_H__
+#define __COLLAPSE_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define COLLAPSE_BUCKETS 64
+#define COLLAPSE_MAX_LAG MAX_OBJECT_SIZE	/* bytes a follower may fall behind the leader */
+#define COLLAPSE_LAG_WAIT 5		/* seconds the leader waits for one before cutting it off */
+
+/* a follower's place in the response, counted from its first byte */
+typedef struct Reader {
+	unsigned long long off;
+	int dropped;		/* fell too far behind and was cut off */
+	struct Reader *next;
+} Reader;
+
+/*
+ * A miss that is being fetched. The leader appends every byte it relays
+ * (the response as it will be cached) and followers stream from the
+ * buffer at their own pace. Everything below key is guarded by lock.
+ */
+typedef struct Pending {
+	char *key;
+	pthread_mutex_t lock;
+	int refcnt;			/* leader plus followers still reading */
+	Reader *readers;	/* followers still reading */
+	int open;			/* buf holds the response from byte 0; new followers may join */
+	int shared;			/* 1 once the head is known storable, -1 if it is not */
+	int done;			/* 0 in progress, 1 complete, -1 failed */
+	char *buf;			/* bytes base to len of the response */
+	unsigned long long base;
+	unsigned long long len;
+	unsigned int size;
+	pthread_cond_t cond;
+	pthread_cond_t drained;	/* a follower moved on; the leader may be waiting for it */
+	struct Pending *next;
+} Pending;
+
+/* in-flight misses by key; each bucket has its own lock, taken before an entry's */
+typedef struct CollapseTable {
+	pthread_mutex_t locks[COLLAPSE_BUCKETS];
+	Pending *buckets[COLLAPSE_BUCKETS];
+
+	/* stats, updated atomically */
+	unsigned long leaders;
+	unsigned long followers;
+} CollapseTable;
+
+void collapse_init(CollapseTable *t);
+Pending *collapse_begin(CollapseTable *t, char *key, int *leader, Reader *r);
+void collapse_append(CollapseTable *t, Pending *p, char *data, unsigned int len);
+void collapse_share(CollapseTable *t, Pending *p, int ok);
+int collapse_wanted(CollapseTable *t, Pending *p, unsigned long long more);
+void collapse_end(CollapseTable *t, Pending *p, int ok);
+int collapse_head(CollapseTable *t, Pending *p, Reader *r, char *dst, unsigned int max);
+int collapse_read(CollapseTable *t, Pending *p, Reader *r, char *dst, unsigned int max);
+void collapse_leave(CollapseTable *t, Pending *p, Reader *r);
+void collapse_release(CollapseTable *t, Pending *p);
+int collapse_stats(CollapseTable *t, char *buf, unsigned int size);
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * connpool.c - idle upstream connections, kept per origin. Besides the
+ * per-origin cap, all idle connections are on one list by age: whenever
+ * the pool is used, those idle past idle_timeout are closed, and the
+ * oldest go to stay under max_idle. An origin with none left is freed.
+ */
+#include "connpool.h"
+
+static unsigned int bucket(char *key);
+static PoolHost *find_host(ConnPool *pool, char *key, int create);
+static void unlink_conn(ConnPool *pool, PoolConn *pc);
+static void drop_conn(ConnPool *pool, PoolConn *pc);
+static void reap(ConnPool *pool, time_t now);
+static int conn_alive(int fd);
+
+void connpool_init(ConnPool *pool, int max_per_host, int max_idle, int idle_timeout, DnsCache *dns) {
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->max_per_host = max_per_host;
+	pool->max_idle = max_idle;
+	pool->idle_timeout = idle_timeout;
+	pool->dns = dns;
+}
+
+static unsigned int bucket(char *key) {
+	unsigned int h = 5381;
+
+	for (; *key; key++)
+		h = h * 33 + (unsigned char)*key;
+	return h % POOL_BUCKETS;
+}
+
+static PoolHost *find_host(ConnPool *pool, char *key, int create) {
+	unsigned int h = bucket(key);
+	PoolHost *ph;
+
+	for (ph = pool->buckets[h]; ph; ph = ph->next)
+		if (!strcmp(ph->key, key))
+			return ph;
+	if (!create)
+		return NULL;
+
+	ph = Calloc(1, sizeof(PoolHost));
+	ph->key = strdup(key);
+	ph->next = pool->buckets[h];
+	pool->buckets[h] = ph;
+	return ph;
+}
+
+/* unlink_conn - take pc off both lists, freeing its origin if that was the last one */
+static void unlink_conn(ConnPool *pool, PoolConn *pc) {
+	PoolHost *ph = pc->host, **pp;
+	PoolConn **cp;
+
+	for (cp = &ph->idle; *cp != pc; cp = &(*cp)->next)
+		;
+	*cp = pc->next;
+	if (--ph->nidle == 0) {
+		for (pp = &pool->buckets[bucket(ph->key)]; *pp != ph; pp = &(*pp)->next)
+			;
+		*pp = ph->next;
+		free(ph->key);
+		free(ph);
+	}
+
+	if (pc->newer)
+		pc->newer->older = pc->older;
+	else
+		pool->newest = pc->older;
+	if (pc->older)
+		pc->older->newer = pc->newer;
+	else
+		pool->oldest = pc->newer;
+	pool->nidle--;
+}
+
+static void drop_conn(ConnPool *pool, PoolConn *pc) {
+	unlink_conn(pool, pc);
+	close(pc->fd);
+	free(pc);
+}
+
+/* reap - close the connections idle past idle_timeout; the oldest are at the end */
+static void reap(ConnPool *pool, time_t now) {
+	while (pool->oldest && now - pool->oldest->last_used > pool->idle_timeout) {
+		drop_conn(pool, pool->oldest);
+		pool->expired++;
+	}
+}
+
+/* conn_alive - an idle connection must have nothing to read: data or EOF means it is done */
+static int conn_alive(int fd) {
+	char c;
+	ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * connpool_get - return a connection to host:port, reusing an idle one if
+ * a live, unexpired one exists and fresh is not set. Returns -1 on connect
+ * errors and -2 on DNS errors, like open_clientfd. New connections resolve
+ * through pool->dns.
+ */
+int connpool_get(ConnPool *pool, char *host, char *port, int fresh, int *reused) {
+	char key[MAXLINE];
+	time_t now = time(NULL);
+	PoolHost *ph;
+	PoolConn *pc;
+	int fd;
+
+	*reused = 0;
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+
+	pthread_mutex_lock(&pool->lock);
+	reap(pool, now);
+	if (!fresh && (ph = find_host(pool, key, 0)) != NULL) {
+		/* the last one taken may free ph */
+		while (ph->nidle > 0) {
+			pc = ph->idle;
+			unlink_conn(pool, pc);
+			fd = pc->fd;
+			free(pc);
+			if (conn_alive(fd)) {
+				pool->reused++;
+				pthread_mutex_unlock(&pool->lock);
+				*reused = 1;
+				return fd;
+			}
+			pool->expired++;
+			close(fd);
+		}
+	}
+	pool->opened++;
+	pthread_mutex_unlock(&pool->lock);
+
+	fd = dns_open_clientfd(pool->dns, host, port);
+	return fd;
+}
+
+/*
+ * connpool_put - park a connection whose last response was fully read.
+ * At max_idle, the connection idle the longest, to any origin, is closed
+ * to make room.
+ */
+void connpool_put(ConnPool *pool, char *host, char *port, int fd) {
+	char key[MAXLINE];
+	time_t now = time(NULL);
+	PoolHost *ph;
+	PoolConn *pc;
+
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+
+	pthread_mutex_lock(&pool->lock);
+	reap(pool, now);
+	if (pool->max_idle <= 0 || ((ph = find_host(pool, key, 0)) && ph->nidle >= pool->max_per_host)) {
+		pthread_mutex_unlock(&pool->lock);
+		close(fd);
+		return;
+	}
+	while (pool->nidle >= pool->max_idle) {
+		drop_conn(pool, pool->oldest);
+		pool->evicted++;
+	}
+	ph = find_host(pool, key, 1);
+	pc = Malloc(sizeof(PoolConn));
+	pc->fd = fd;
+	pc->last_used = now;
+	pc->host = ph;
+	pc->next = ph->idle;
+	ph->idle = pc;
+	ph->nidle++;
+	pc->older = pool->newest;
+	pc->newer = NULL;
+	if (pool->newest)
+		pool->newest->newer = pc;
+	else
+		pool->oldest = pc;
+	pool->newest = pc;
+	pool->nidle++;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int connpool_stats(ConnPool *pool, char *buf, unsigned int size) {
+	unsigned long total;
+	int len;
+
+	pthread_mutex_lock(&pool->lock);
+	total = pool->opened + pool->reused;
+	len = snprintf(buf, size,
+		"upstream_opened: %lu\nupstream_reused: %lu\nupstream_expired: %lu\nupstream_evicted: %lu\n"
+		"upstream_idle: %d\nupstream_reuse_ratio: %.3f\n",
+		pool->opened, pool->reused, pool->expired, pool->evicted, pool->nidle,
+		total ? (double)pool->reused / total : 0.0);
+	pthread_mutex_unlock(&pool->lock);
+	return len;
+}
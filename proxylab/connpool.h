@@ -0,0 +1,52 @@
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+#include "csapp.h"
+#include "dnscache.h"
+
+#define POOL_BUCKETS 64
+#define DEFAULT_POOL_PER_HOST 4		/* idle connections kept per origin */
+#define DEFAULT_POOL_IDLE 30		/* seconds an idle connection is kept */
+#define DEFAULT_POOL_MAX_IDLE 256	/* idle connections kept across all origins */
+
+typedef struct PoolConn {
+	int fd;
+	time_t last_used;
+	struct PoolHost *host;
+	struct PoolConn *next;		/* in the host's list */
+	struct PoolConn *newer;		/* in the pool's list, across hosts */
+	struct PoolConn *older;
+} PoolConn;
+
+/* idle persistent connections to one origin ("host:port"); freed once empty */
+typedef struct PoolHost {
+	char *key;
+	PoolConn *idle;		/* most recently used first */
+	int nidle;
+	struct PoolHost *next;
+} PoolHost;
+
+typedef struct ConnPool {
+	pthread_mutex_t lock;
+	PoolHost *buckets[POOL_BUCKETS];
+	int max_per_host;	/* 0 disables pooling */
+	int max_idle;
+	int idle_timeout;
+	PoolConn *newest;	/* every idle connection, most recently parked first */
+	PoolConn *oldest;
+	int nidle;
+	DnsCache *dns;		/* resolves origins for new connections */
+
+	/* stats */
+	unsigned long opened;
+	unsigned long reused;
+	unsigned long expired;
+	unsigned long evicted;	/* closed to stay under max_idle */
+} ConnPool;
+
+void connpool_init(ConnPool *pool, int max_per_host, int max_idle, int idle_timeout, DnsCache *dns);
+int connpool_get(ConnPool *pool, char *host, char *port, int fresh, int *reused);
+void connpool_put(ConnPool *pool, char *host, char *port, int fd);
+int connpool_stats(ConnPool *pool, char *buf, unsigned int size);
+
+#endif
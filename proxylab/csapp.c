@@ -664,26 +664,40 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). The line is
+ * located with memchr and copied from the buffer in one piece.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
+    size_t n = 0, cnt;
+    int rc;
+    char *bufp = usrbuf, *eol;
+
+    while (n + 1 < maxlen) {
+	if (rp->rio_cnt <= 0) {
+	    /* let rio_read refill the buffer and take the first byte */
+	    if ((rc = rio_read(rp, bufp, 1)) < 0)
+		return -1;     /* error */
+	    if (rc == 0)
+		break;         /* EOF */
+	    n++;
+	    if (*bufp++ == '\n')
 		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+	    continue;
+	}
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((eol = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = eol - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
+	if (eol)
+	    break;
     }
     *bufp = 0;
     return n;
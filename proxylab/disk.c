@@ -0,0 +1,470 @@
+/*
+ * disk.c - second cache tier on local disk.
+ *
+ * Objects evicted from the memory cache are appended to log-structured
+ * segment files in dir ("<seq>.seg", each mapped whole with mmap). Only
+ * the index lives in memory: key hash, segment, offset and length per
+ * object; the key itself is checked against the copy in the record.
+ * Hits are pinned and sent with sendfile. Each record keeps the object's
+ * absolute expiry, so its freshness does not restart when it comes back
+ * to memory.
+ *
+ * Segments form a ring and are reclaimed FIFO: when the active segment
+ * is full, the next file is created and the oldest one is retired. Its
+ * live records that were hit since they were written are copied into the
+ * new segment first, so hot objects survive the sweep; the rest are
+ * dropped. On startup the index is rebuilt by scanning the segments from
+ * oldest to newest. A crash can leave a record header on disk without
+ * all of its data, so rebuilt records are checked against their CRC on
+ * their first hit.
+ */
+#include <dirent.h>
+#include <sys/sendfile.h>
+
+#include "disk.h"
+
+/* segment layout: SegHeader, then records padded to 8 bytes */
+typedef struct {
+	unsigned int magic;
+	unsigned int pad;
+	unsigned long long seq;
+} SegHeader;
+
+typedef struct {
+	unsigned int magic;			/* written last */
+	unsigned int key_len;		/* with the NUL */
+	unsigned int data_len;
+	unsigned int crc;			/* CRC-32 of key and data */
+	unsigned long long hash;
+	long long expires;
+} RecHeader;
+
+#define REC_SIZE(key_len, data_len) ((sizeof(RecHeader) + (key_len) + (data_len) + 7) & ~7u)
+#define REC_KEY(seg, off) ((seg)->map + (off) + sizeof(RecHeader))
+
+static unsigned int crc_table[256];
+
+static void crc_init(void);
+static unsigned int crc32(const char *buf, unsigned int len);
+static Segment *seg_create(DiskCache *dc, unsigned long long seq);
+static Segment *seg_open(DiskCache *dc, char *name);
+static void seg_scan(DiskCache *dc, Segment *seg);
+static void seg_put(Segment *seg);
+static void seg_retire(DiskCache *dc, Segment *seg);
+static int seg_cmp(const void *a, const void *b);
+static DiskEntry **find_entry(DiskCache *dc, char *index, unsigned long long hash);
+static void index_set(DiskCache *dc, char *index, unsigned long long hash, Segment *seg, unsigned int off, unsigned int len, int verified);
+static void append(DiskCache *dc, char *index, unsigned long long hash, char *data, unsigned int len, time_t expires);
+static int advance(DiskCache *dc, unsigned int reserve);
+static void reclaim(DiskCache *dc, Segment *old, unsigned int reserve);
+
+/* crc_init - the table for the reflected CRC-32 polynomial (as in zlib) */
+static void crc_init(void) {
+	unsigned int c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static unsigned int crc32(const char *buf, unsigned int len) {
+	unsigned int c = 0xffffffff;
+
+	while (len--)
+		c = crc_table[(c ^ (unsigned char)*buf++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffff;
+}
+
+static Segment *seg_create(DiskCache *dc, unsigned long long seq) {
+	char path[MAXLINE];
+	SegHeader *header;
+	Segment *seg;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%llu.seg", dc->dir, seq);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		return NULL;
+	if (ftruncate(fd, dc->seg_size) < 0) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	seg = Calloc(1, sizeof(Segment));
+	seg->fd = fd;
+	seg->size = dc->seg_size;
+	seg->seq = seq;
+	seg->refcnt = 1;
+	seg->used = sizeof(SegHeader);
+	if ((seg->map = mmap(NULL, dc->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		unlink(path);
+		free(seg);
+		return NULL;
+	}
+	header = (SegHeader *)seg->map;
+	header->seq = seq;
+	header->magic = DISK_SEG_MAGIC;
+	return seg;
+}
+
+/* seg_open - map an existing segment file; unusable files are removed */
+static Segment *seg_open(DiskCache *dc, char *name) {
+	char path[MAXLINE];
+	struct stat st;
+	SegHeader *header;
+	Segment *seg;
+	char *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dc->dir, name);
+	if ((fd = open(path, O_RDWR)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size != dc->seg_size ||
+			(map = mmap(NULL, dc->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	header = (SegHeader *)map;
+	if (header->magic != DISK_SEG_MAGIC || header->seq != strtoull(name, NULL, 10)) {
+		munmap(map, dc->seg_size);
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	seg = Calloc(1, sizeof(Segment));
+	seg->fd = fd;
+	seg->map = map;
+	seg->size = dc->seg_size;
+	seg->seq = header->seq;
+	seg->refcnt = 1;
+	seg->used = sizeof(SegHeader);
+	return seg;
+}
+
+/* seg_scan - index the records of seg up to the first incomplete one */
+static void seg_scan(DiskCache *dc, Segment *seg) {
+	unsigned int off = sizeof(SegHeader), size;
+	RecHeader *rec;
+
+	while (off + sizeof(RecHeader) <= dc->seg_size) {
+		rec = (RecHeader *)(seg->map + off);
+		if (rec->magic != DISK_REC_MAGIC || !rec->key_len || rec->key_len > MAXLINE)
+			break;
+		size = REC_SIZE(rec->key_len, rec->data_len);
+		if (size > dc->seg_size - off || REC_KEY(seg, off)[rec->key_len - 1] != '\0')
+			break;
+		index_set(dc, REC_KEY(seg, off), rec->hash, seg, off, rec->data_len, 0);
+		off += size;
+	}
+	seg->used = off;
+}
+
+static void seg_put(Segment *seg) {
+	if (--seg->refcnt == 0) {
+		munmap(seg->map, seg->size);
+		close(seg->fd);
+		free(seg);
+	}
+}
+
+/* seg_retire - remove the file; readers still holding seg keep it mapped */
+static void seg_retire(DiskCache *dc, Segment *seg) {
+	char path[MAXLINE];
+
+	snprintf(path, sizeof(path), "%s/%llu.seg", dc->dir, seg->seq);
+	unlink(path);
+	seg_put(seg);
+}
+
+static int seg_cmp(const void *a, const void *b) {
+	const Segment *x = *(Segment **)a, *y = *(Segment **)b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * disk_init - open or create the segments in dir, size bytes in all, and
+ * index what they hold. Returns -1 if dir cannot be used.
+ */
+int disk_init(DiskCache *dc, char *dir, unsigned long long size) {
+	Segment *found[4 * DISK_SEGMENTS], *seg;
+	struct dirent *de;
+	DIR *d;
+	int n = 0, i;
+
+	memset(dc, 0, sizeof(*dc));
+	pthread_mutex_init(&dc->lock, NULL);
+	crc_init();
+	dc->dir = dir;
+	/* offsets in a segment are 32-bit */
+	if (size / DISK_SEGMENTS > DISK_MAX_SEGMENT)
+		return -1;
+	dc->seg_size = size / DISK_SEGMENTS;
+	if (dc->seg_size < 4 * MAXBUF)
+		dc->seg_size = 4 * MAXBUF;
+	dc->seg_size &= ~7u;
+	for (dc->nbuckets = 1024; dc->nbuckets < size / MAXBUF; dc->nbuckets *= 2)
+		;
+	dc->buckets = Calloc(dc->nbuckets, sizeof(DiskEntry *));
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+	if (!(d = opendir(dir)))
+		return -1;
+	while ((de = readdir(d)) != NULL && n < 4 * DISK_SEGMENTS) {
+		if (!strstr(de->d_name, ".seg") || !isdigit((unsigned char)de->d_name[0]))
+			continue;
+		if ((seg = seg_open(dc, de->d_name)) != NULL)
+			found[n++] = seg;
+	}
+	closedir(d);
+
+	/* the newest DISK_SEGMENTS, oldest first, fill the ring; older ones go */
+	qsort(found, n, sizeof(Segment *), seg_cmp);
+	for (i = 0; i < n - DISK_SEGMENTS; i++)
+		seg_retire(dc, found[i]);
+	for (; i < n; i++) {
+		seg = found[i];
+		dc->active = (dc->segs[0] ? dc->active + 1 : 0);
+		dc->segs[dc->active] = seg;
+		seg_scan(dc, seg);
+		dc->next_seq = seg->seq + 1;
+	}
+
+	if (!dc->segs[0]) {
+		if (!(dc->segs[0] = seg_create(dc, dc->next_seq++)))
+			return -1;
+		dc->active = 0;
+	}
+	return 0;
+}
+
+/* disk_destruct - drop the index and unmap the segments; the files stay */
+void disk_destruct(DiskCache *dc) {
+	DiskEntry *e, *next;
+	unsigned int i;
+
+	for (i = 0; i < dc->nbuckets; i++)
+		for (e = dc->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	free(dc->buckets);
+	for (i = 0; i < DISK_SEGMENTS; i++)
+		if (dc->segs[i])
+			seg_put(dc->segs[i]);
+	pthread_mutex_destroy(&dc->lock);
+}
+
+/* find_entry - the link pointing at index's entry, or at the NULL ending its chain */
+static DiskEntry **find_entry(DiskCache *dc, char *index, unsigned long long hash) {
+	DiskEntry **pp;
+
+	for (pp = &dc->buckets[hash & (dc->nbuckets - 1)]; *pp; pp = &(*pp)->next)
+		if ((*pp)->hash == hash && !strcmp(REC_KEY((*pp)->seg, (*pp)->off), index))
+			break;
+	return pp;
+}
+
+static void index_set(DiskCache *dc, char *index, unsigned long long hash, Segment *seg, unsigned int off, unsigned int len, int verified) {
+	DiskEntry **pp = find_entry(dc, index, hash), *e = *pp;
+
+	if (!e) {
+		e = *pp = Calloc(1, sizeof(DiskEntry));
+		e->hash = hash;
+		dc->objects++;
+	}
+	e->seg = seg;
+	e->off = off;
+	e->length = len;
+	e->hot = 0;
+	e->verified = verified;
+}
+
+/* append - write a record to the active segment, which has room for it */
+static void append(DiskCache *dc, char *index, unsigned long long hash, char *data, unsigned int len, time_t expires) {
+	Segment *seg = dc->segs[dc->active];
+	unsigned int key_len = strlen(index) + 1, off = seg->used;
+	RecHeader *rec = (RecHeader *)(seg->map + off);
+
+	memcpy(REC_KEY(seg, off), index, key_len);
+	memcpy(REC_KEY(seg, off) + key_len, data, len);
+	rec->key_len = key_len;
+	rec->data_len = len;
+	rec->crc = crc32(REC_KEY(seg, off), key_len + len);
+	rec->hash = hash;
+	rec->expires = expires;
+	rec->magic = DISK_REC_MAGIC;
+	seg->used += REC_SIZE(key_len, len);
+	index_set(dc, index, hash, seg, off, len, 1);
+}
+
+/*
+ * advance - start a new active segment in the next ring slot and reclaim
+ * the oldest segment that held it, keeping reserve bytes free for the
+ * record that asked. Returns -1 if no file can be created.
+ */
+static int advance(DiskCache *dc, unsigned int reserve) {
+	int next = (dc->active + 1) % DISK_SEGMENTS;
+	Segment *old = dc->segs[next], *seg;
+
+	if (!(seg = seg_create(dc, dc->next_seq)))
+		return -1;
+	dc->next_seq++;
+	dc->segs[next] = seg;
+	dc->active = next;
+	if (old) {
+		reclaim(dc, old, reserve);
+		seg_retire(dc, old);
+	}
+	return 0;
+}
+
+/*
+ * reclaim - move old's hot live records to the active segment, short of
+ * its last reserve bytes, and drop the rest
+ */
+static void reclaim(DiskCache *dc, Segment *old, unsigned int reserve) {
+	Segment *seg = dc->segs[dc->active];
+	unsigned int off, size;
+	DiskEntry **pp, *e;
+	RecHeader *rec;
+
+	for (off = sizeof(SegHeader); off < old->used; off += size) {
+		rec = (RecHeader *)(old->map + off);
+		size = REC_SIZE(rec->key_len, rec->data_len);
+
+		for (pp = &dc->buckets[rec->hash & (dc->nbuckets - 1)]; (e = *pp); pp = &e->next)
+			if (e->seg == old && e->off == off)
+				break;
+		if (!e)
+			continue;	/* superseded by a newer copy */
+
+		if (e->hot && seg->used + size + reserve <= dc->seg_size) {
+			memcpy(seg->map + seg->used, old->map + off, size);
+			e->seg = seg;
+			e->off = seg->used;
+			e->hot = 0;
+			seg->used += size;
+			dc->reinserted++;
+		}
+		else {
+			*pp = e->next;
+			free(e);
+			dc->objects--;
+			dc->dropped++;
+		}
+	}
+}
+
+/*
+ * disk_put - store an object evicted from memory, fresh until expires. An
+ * identical copy that is already on disk only takes the new expiry and is
+ * marked hot.
+ */
+void disk_put(DiskCache *dc, char *index, unsigned long long hash, char *data, unsigned int len, time_t expires) {
+	unsigned int size = REC_SIZE(strlen(index) + 1, len);
+	DiskEntry *e;
+
+	if (size > dc->seg_size - sizeof(SegHeader))
+		return;
+
+	pthread_mutex_lock(&dc->lock);
+	e = *find_entry(dc, index, hash);
+	if (e && e->length == len && !memcmp(REC_KEY(e->seg, e->off) + strlen(index) + 1, data, len)) {
+		((RecHeader *)(e->seg->map + e->off))->expires = expires;
+		e->hot = 1;
+		pthread_mutex_unlock(&dc->lock);
+		return;
+	}
+	/* advance leaves room for the record, but check: append writes blindly */
+	if ((dc->segs[dc->active]->used + size <= dc->seg_size || advance(dc, size) == 0) &&
+			dc->segs[dc->active]->used + size <= dc->seg_size) {
+		append(dc, index, hash, data, len, expires);
+		dc->writes++;
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
+
+/*
+ * disk_lookup - pin the object stored for index. Returns 0 and fills ref
+ * on a hit, -1 on a miss. A rebuilt record that fails its CRC is dropped
+ * and counts as a miss. The caller sends from ref and calls disk_release.
+ */
+int disk_lookup(DiskCache *dc, char *index, unsigned long long hash, DiskRef *ref) {
+	DiskEntry **pp, *e;
+	RecHeader *rec;
+
+	pthread_mutex_lock(&dc->lock);
+	pp = find_entry(dc, index, hash);
+	if ((e = *pp) != NULL && !e->verified) {
+		rec = (RecHeader *)(e->seg->map + e->off);
+		if (crc32(REC_KEY(e->seg, e->off), rec->key_len + rec->data_len) == rec->crc)
+			e->verified = 1;
+		else {
+			*pp = e->next;
+			free(e);
+			e = NULL;
+			dc->objects--;
+			dc->corrupt++;
+		}
+	}
+	if (!e) {
+		dc->misses++;
+		pthread_mutex_unlock(&dc->lock);
+		return -1;
+	}
+	e->hot = 1;
+	dc->hits++;
+	ref->seg = e->seg;
+	ref->seg->refcnt++;
+	ref->offset = e->off + sizeof(RecHeader) + strlen(index) + 1;
+	ref->data = e->seg->map + ref->offset;
+	ref->length = e->length;
+	ref->expires = ((RecHeader *)(e->seg->map + e->off))->expires;
+	pthread_mutex_unlock(&dc->lock);
+	return 0;
+}
+
+void disk_release(DiskCache *dc, DiskRef *ref) {
+	pthread_mutex_lock(&dc->lock);
+	seg_put(ref->seg);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+/* disk_send - sendfile the object from byte from on. Returns -1 on errors. */
+int disk_send(int fd, DiskRef *ref, unsigned int from) {
+	off_t off = ref->offset + from;
+	size_t left = ref->length - from;
+	ssize_t n;
+
+	while (left > 0) {
+		if ((n = sendfile(fd, ref->seg->fd, &off, left)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		left -= n;
+	}
+	return 0;
+}
+
+int disk_stats(DiskCache *dc, char *buf, unsigned int size) {
+	int len;
+
+	pthread_mutex_lock(&dc->lock);
+	len = snprintf(buf, size,
+		"disk_hits: %lu\ndisk_misses: %lu\ndisk_writes: %lu\ndisk_reinserted: %lu\n"
+		"disk_dropped: %lu\ndisk_corrupt: %lu\ndisk_objects: %lu\n",
+		dc->hits, dc->misses, dc->writes, dc->reinserted, dc->dropped, dc->corrupt, dc->objects);
+	pthread_mutex_unlock(&dc->lock);
+	return len;
+}
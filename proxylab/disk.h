@@ -0,0 +1,75 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+
+#define DISK_SEGMENTS 16			/* segment files the budget is split into */
+#define DEFAULT_DISK_SIZE 1024		/* MB */
+#define DISK_MAX_SEGMENT (1U << 30)	/* bytes; bounds the total at 16 GB */
+#define DISK_MAX_SIZE (DISK_SEGMENTS * (DISK_MAX_SEGMENT >> 20))	/* MB */
+#define DISK_SEG_MAGIC 0x32474553	/* "SEG2"; older segments are discarded */
+#define DISK_REC_MAGIC 0x43455258	/* "XREC" */
+
+/*
+ * One segment file, mapped whole. Records are appended until it is full;
+ * it is never written again after that. Readers pin it, so a segment
+ * that is reclaimed (its file unlinked) stays mapped until the last
+ * reader is done.
+ */
+typedef struct Segment {
+	int fd;
+	char *map;
+	unsigned int size;
+	unsigned long long seq;		/* file name and age; higher is newer */
+	unsigned int used;
+	int refcnt;					/* the slot's reference plus readers */
+} Segment;
+
+typedef struct DiskEntry {
+	unsigned long long hash;
+	Segment *seg;
+	unsigned int off;			/* record offset in seg */
+	unsigned int length;		/* object bytes */
+	int hot;					/* hit since written; kept on reclaim */
+	int verified;				/* CRC checked, or written by this process */
+	struct DiskEntry *next;
+} DiskEntry;
+
+typedef struct DiskCache {
+	pthread_mutex_t lock;
+	char *dir;
+	unsigned int seg_size;
+	Segment *segs[DISK_SEGMENTS];	/* ring, oldest after active */
+	int active;
+	unsigned long long next_seq;
+	DiskEntry **buckets;
+	unsigned int nbuckets;			/* a power of 2 */
+
+	/* stats */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long writes;
+	unsigned long reinserted;
+	unsigned long dropped;
+	unsigned long corrupt;			/* records whose CRC did not match */
+	unsigned long objects;
+} DiskCache;
+
+/* a pinned object; data points into the segment mapping */
+typedef struct DiskRef {
+	Segment *seg;
+	char *data;
+	unsigned int length;
+	time_t expires;				/* as it was in memory */
+	off_t offset;				/* of data in the segment file */
+} DiskRef;
+
+int disk_init(DiskCache *dc, char *dir, unsigned long long size);
+void disk_destruct(DiskCache *dc);
+void disk_put(DiskCache *dc, char *index, unsigned long long hash, char *data, unsigned int len, time_t expires);
+int disk_lookup(DiskCache *dc, char *index, unsigned long long hash, DiskRef *ref);
+void disk_release(DiskCache *dc, DiskRef *ref);
+int disk_send(int fd, DiskRef *ref, unsigned int from);
+int disk_stats(DiskCache *dc, char *buf, unsigned int size);
+
+#endif
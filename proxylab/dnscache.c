@@ -0,0 +1,246 @@
+/*
+ * dnscache.c - resolver cache shared by all proxy threads.
+ *
+ * Lookups run getaddrinfo outside the cache lock, so different hosts
+ * resolve concurrently. A second lookup of a host that is already being
+ * resolved waits for that result instead of starting its own. Results are
+ * kept for ttl seconds and failures for neg_ttl seconds; getaddrinfo does
+ * not report record TTLs. An optional hosts file ("address name...")
+ * pins entries that never expire. Other entries are capped at
+ * DNS_MAX_ENTRIES: adding one drops the expired entries in its bucket and,
+ * at the cap, the least recently used ones.
+ */
+#include "dnscache.h"
+
+static unsigned int bucket(char *host);
+static DnsEntry *find_entry(DnsCache *dc, char *host);
+static DnsEntry *new_entry(DnsCache *dc, char *host, int pinned);
+static int evictable(DnsEntry *e);
+static void drop_entry(DnsCache *dc, DnsEntry *e);
+static void lru_unlink(DnsCache *dc, DnsEntry *e);
+static void lru_push(DnsCache *dc, DnsEntry *e);
+static int load_hosts(DnsCache *dc, char *hosts_file);
+
+int dns_init(DnsCache *dc, int ttl, int neg_ttl, char *hosts_file) {
+	memset(dc, 0, sizeof(*dc));
+	pthread_mutex_init(&dc->lock, NULL);
+	pthread_cond_init(&dc->done, NULL);
+	dc->ttl = ttl;
+	dc->neg_ttl = neg_ttl;
+
+	if (hosts_file)
+		return load_hosts(dc, hosts_file);
+	return 0;
+}
+
+static unsigned int bucket(char *host) {
+	unsigned int h = 5381;
+
+	for (; *host; host++)
+		h = h * 33 + (unsigned char)tolower(*host);
+	return h % DNS_BUCKETS;
+}
+
+static DnsEntry *find_entry(DnsCache *dc, char *host) {
+	DnsEntry *e;
+
+	for (e = dc->buckets[bucket(host)]; e; e = e->next)
+		if (!strcasecmp(e->host, host))
+			return e;
+	return NULL;
+}
+
+/*
+ * new_entry - add host, in the failed state. Room for an entry not pinned
+ * is made first: expired entries in its bucket go, then the least
+ * recently used ones while the cache is at DNS_MAX_ENTRIES.
+ */
+static DnsEntry *new_entry(DnsCache *dc, char *host, int pinned) {
+	unsigned int h = bucket(host);
+	time_t now = time(NULL);
+	DnsEntry *e, *next;
+
+	if (!pinned) {
+		for (e = dc->buckets[h]; e; e = next) {
+			next = e->next;
+			if (evictable(e) && now >= e->expires)
+				drop_entry(dc, e);
+		}
+		for (e = dc->oldest; e && dc->count >= DNS_MAX_ENTRIES; e = next) {
+			next = e->newer;
+			if (evictable(e))
+				drop_entry(dc, e);
+		}
+	}
+
+	e = Calloc(1, sizeof(DnsEntry));
+	e->host = strdup(host);
+	e->state = DNS_FAIL;
+	e->pinned = pinned;
+	e->next = dc->buckets[h];
+	dc->buckets[h] = e;
+	if (!pinned) {
+		lru_push(dc, e);
+		dc->count++;
+	}
+	return e;
+}
+
+/* evictable - not pinned, and no lookup holds on to it */
+static int evictable(DnsEntry *e) {
+	return !e->pinned && e->state != DNS_PENDING && !e->waiters;
+}
+
+static void drop_entry(DnsCache *dc, DnsEntry *e) {
+	DnsEntry **pp;
+
+	for (pp = &dc->buckets[bucket(e->host)]; *pp != e; pp = &(*pp)->next)
+		;
+	*pp = e->next;
+	lru_unlink(dc, e);
+	dc->count--;
+	dc->evicted++;
+	free(e->host);
+	free(e);
+}
+
+static void lru_unlink(DnsCache *dc, DnsEntry *e) {
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		dc->newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		dc->oldest = e->newer;
+	e->newer = e->older = NULL;
+}
+
+static void lru_push(DnsCache *dc, DnsEntry *e) {
+	e->older = dc->newest;
+	e->newer = NULL;
+	if (dc->newest)
+		dc->newest->newer = e;
+	else
+		dc->oldest = e;
+	dc->newest = e;
+}
+
+static int load_hosts(DnsCache *dc, char *hosts_file) {
+	char line[MAXLINE], *tok, *save;
+	struct in_addr addr;
+	DnsEntry *e;
+	FILE *fp;
+
+	if (!(fp = fopen(hosts_file, "r")))
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if ((tok = strchr(line, '#')))
+			*tok = '\0';
+		if (!(tok = strtok_r(line, " \t\r\n", &save)) || inet_pton(AF_INET, tok, &addr) != 1)
+			continue;
+		while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+			if (!(e = find_entry(dc, tok)))
+				e = new_entry(dc, tok, 1);
+			e->state = DNS_OK;
+			e->addr = addr;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* dns_lookup - resolve host to an IPv4 address. Returns 0 on success, -1 on failure. */
+int dns_lookup(DnsCache *dc, char *host, struct in_addr *addr) {
+	struct addrinfo hints, *res;
+	DnsEntry *e;
+	int rc, counted = 0;
+
+	pthread_mutex_lock(&dc->lock);
+	if (!(e = find_entry(dc, host)))
+		e = new_entry(dc, host, 0);
+	else if (!e->pinned) {
+		lru_unlink(dc, e);
+		lru_push(dc, e);
+	}
+	while (e->state == DNS_PENDING) {
+		if (!counted++)
+			dc->shared++;
+		e->waiters++;
+		pthread_cond_wait(&dc->done, &dc->lock);
+		e->waiters--;
+	}
+	if (counted || e->pinned || time(NULL) < e->expires) {
+		if (!counted) {
+			if (e->state == DNS_OK)
+				dc->hits++;
+			else
+				dc->neg_hits++;
+		}
+		*addr = e->addr;
+		rc = (e->state == DNS_OK) ? 0 : -1;
+		pthread_mutex_unlock(&dc->lock);
+		return rc;
+	}
+	e->state = DNS_PENDING;
+	dc->misses++;
+	pthread_mutex_unlock(&dc->lock);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(host, NULL, &hints, &res);
+
+	pthread_mutex_lock(&dc->lock);
+	if (!rc) {
+		e->addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+		e->state = DNS_OK;
+		e->expires = time(NULL) + dc->ttl;
+		freeaddrinfo(res);
+	}
+	else {
+		e->state = DNS_FAIL;
+		e->expires = time(NULL) + dc->neg_ttl;
+	}
+	*addr = e->addr;
+	pthread_cond_broadcast(&dc->done);
+	pthread_mutex_unlock(&dc->lock);
+
+	return rc ? -1 : 0;
+}
+
+/*
+ * dns_open_clientfd - open_clientfd through the cache. Returns -1 on
+ * connect errors and -2 on DNS errors.
+ */
+int dns_open_clientfd(DnsCache *dc, char *host, char *port) {
+	struct sockaddr_in serveraddr;
+	int clientfd;
+
+	memset(&serveraddr, 0, sizeof(serveraddr));
+	if (dns_lookup(dc, host, &serveraddr.sin_addr) < 0)
+		return -2;
+	serveraddr.sin_family = AF_INET;
+	serveraddr.sin_port = htons(atoi(port));
+
+	if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(clientfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0) {
+		close(clientfd);
+		return -1;
+	}
+	return clientfd;
+}
+
+int dns_stats(DnsCache *dc, char *buf, unsigned int size) {
+	int len;
+
+	pthread_mutex_lock(&dc->lock);
+	len = snprintf(buf, size,
+		"dns_hits: %lu\ndns_negative_hits: %lu\ndns_misses: %lu\ndns_shared: %lu\n"
+		"dns_entries: %d\ndns_evicted: %lu\n",
+		dc->hits, dc->neg_hits, dc->misses, dc->shared, dc->count, dc->evicted);
+	pthread_mutex_unlock(&dc->lock);
+	return len;
+}
@@ -0,0 +1,50 @@
+#ifndef __DNSCACHE_H__
+#define __DNSCACHE_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 256
+#define DEFAULT_DNS_TTL 60		/* seconds a resolved address is reused */
+#define DEFAULT_DNS_NEG_TTL 5	/* seconds a failed lookup is remembered */
+#define DNS_MAX_ENTRIES 4096	/* cached hosts, besides those pinned */
+
+#define DNS_PENDING 0	/* a lookup is in flight; wait on done */
+#define DNS_OK 1
+#define DNS_FAIL 2
+
+typedef struct DnsEntry {
+	char *host;
+	int state;
+	int pinned;				/* from the hosts file, never expires */
+	int waiters;			/* lookups waiting for this one to finish */
+	struct in_addr addr;
+	time_t expires;
+	struct DnsEntry *next;
+	struct DnsEntry *newer;	/* recency list of the entries not pinned */
+	struct DnsEntry *older;
+} DnsEntry;
+
+typedef struct DnsCache {
+	pthread_mutex_t lock;
+	pthread_cond_t done;	/* broadcast whenever a lookup finishes */
+	DnsEntry *buckets[DNS_BUCKETS];
+	DnsEntry *newest;
+	DnsEntry *oldest;
+	int count;				/* entries not pinned */
+	int ttl;
+	int neg_ttl;
+
+	/* stats */
+	unsigned long hits;
+	unsigned long neg_hits;
+	unsigned long misses;
+	unsigned long shared;	/* lookups that waited for one in flight */
+	unsigned long evicted;	/* expired or least recently used entries dropped */
+} DnsCache;
+
+int dns_init(DnsCache *dc, int ttl, int neg_ttl, char *hosts_file);
+int dns_lookup(DnsCache *dc, char *host, struct in_addr *addr);
+int dns_open_clientfd(DnsCache *dc, char *host, char *port);
+int dns_stats(DnsCache *dc, char *buf, unsigned int size);
+
+#endif
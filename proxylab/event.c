@@ -0,0 +1,518 @@
+/*
+ * event.c - event-driven mode of the proxy (--mode=events).
+ *
+ * Every loop thread owns an epoll instance. All loops watch the shared,
+ * non-blocking listening socket (EPOLLEXCLUSIVE, so one loop wakes per
+ * connection) and drive a small state machine for each connection:
+ *
+ *   READ_REQUEST -> cache hit            -> RESPOND (write object, close)
+ *                -> cache miss           -> CONNECT -> SEND_REQUEST -> RELAY
+ *
+ * A connection only holds a request buffer, one MAXBUF relay buffer and the
+ * part of the response kept for the cache, instead of a thread stack. All
+ * three come from the buffer pool (bufpool.c), so the loop's memory
+ * follows the connections in flight, not the largest object.
+ */
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+
+#include "proxy.h"
+#include "event.h"
+#include "stats.h"
+#include "log.h"
+#include "procs.h"
+#include "bufpool.h"
+
+#define MAX_EVENTS 64
+#define MIN_REQUEST 2048		/* first request buffer, doubled as needed */
+#define MAX_REQUEST (4*MAXBUF)	/* longest request header accepted */
+
+enum conn_state {
+	ST_READ_REQUEST,	/* reading the request header from the client */
+	ST_CONNECT,			/* non-blocking connect to the server in progress */
+	ST_SEND_REQUEST,	/* writing the rewritten request to the server */
+	ST_RELAY,			/* copying the response from the server to the client */
+	ST_RESPOND			/* writing buf to the client, then closing */
+};
+
+typedef struct conn conn_t;
+
+typedef struct endpoint {
+	conn_t *conn;
+	int fd;
+	unsigned int events;	/* events currently registered with epoll */
+} endpoint_t;
+
+struct conn {
+	enum conn_state state;
+	int epfd;
+	endpoint_t client;
+	endpoint_t server;
+	Buf *io;				/* request bytes, then the relay buffer or a response */
+	char *buf;				/* bytes pending to the client, in io or the cached object */
+	unsigned int len;		/* valid bytes in buf */
+	unsigned int off;		/* bytes of buf already consumed/written */
+	char *request;			/* rewritten request for the server */
+	char *cache_index;
+	BufChain copy;			/* response copy for the cache */
+	int copying;			/* 0 once the copy is too large */
+	int credentials;		/* the request carries Authorization or Cookie */
+	CacheObject *hit;		/* cached object buf points into, if any */
+	unsigned long long start;	/* stats_now when the request was parsed, 0 before */
+	unsigned long long mark;	/* connect started or request sent, for the timers */
+	unsigned long long sent;	/* response bytes written to the client, for the access log */
+	const char *result;		/* "hit", "miss" or "error", for the access log */
+};
+
+static void *loop_main(void *vargp);
+static void accept_all(int epfd, int listenfd);
+static void watch(conn_t *c, endpoint_t *ep, unsigned int events);
+static void conn_close(conn_t *c);
+static void on_event(endpoint_t *ep, unsigned int events);
+static void read_request_bytes(conn_t *c);
+static void process_request(conn_t *c, HttpRequest *req);
+static void start_connect(conn_t *c, char *host, char *port);
+static void send_request(conn_t *c);
+static void relay_response(conn_t *c);
+static void flush_client(conn_t *c);
+static void respond(conn_t *c, Buf *b, char *data, unsigned int len);
+
+void event_loop_run(int listenfd, int nloops) {
+	pthread_t tid;
+	int i;
+
+	if (nloops <= 0)
+		nloops = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nloops <= 0)
+		nloops = 1;
+
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+	for (i = 1; i < nloops; i++)
+		Pthread_create(&tid, NULL, loop_main, (void *)(long)listenfd);
+	loop_main((void *)(long)listenfd);
+}
+
+static void *loop_main(void *vargp) {
+	int listenfd = (int)(long)vargp;
+	struct epoll_event ev, events[MAX_EVENTS];
+	int epfd, n, i;
+
+	if ((epfd = epoll_create1(0)) < 0)
+		unix_error("epoll_create1 error");
+
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;		/* NULL marks the listening socket */
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+		unix_error("epoll_ctl error");
+
+	while (1) {
+		if ((n = epoll_wait(epfd, events, MAX_EVENTS, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			unix_error("epoll_wait error");
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL)
+				accept_all(epfd, listenfd);
+			else
+				on_event(events[i].data.ptr, events[i].events);
+		}
+	}
+	return NULL;
+}
+
+static void accept_all(int epfd, int listenfd) {
+	conn_t *c;
+	int fd;
+
+	while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		c = Calloc(1, sizeof(conn_t));
+		c->state = ST_READ_REQUEST;
+		c->epfd = epfd;
+		c->client.conn = c;
+		c->client.fd = fd;
+		c->server.conn = c;
+		c->server.fd = -1;
+		watch(c, &c->client, EPOLLIN);
+		stats_add(STAT_CONN_OPENED, 1);
+		procs_add(1, 0);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		LOG(LOG_ERROR, "msg=\"accept error\" error=\"%s\"", strerror(errno));
+}
+
+/* watch - register interest in events (0 to stop watching) for one endpoint */
+static void watch(conn_t *c, endpoint_t *ep, unsigned int events) {
+	struct epoll_event ev;
+	int op;
+
+	if (ep->events == events)
+		return;
+	if (!ep->events)
+		op = EPOLL_CTL_ADD;
+	else if (!events)
+		op = EPOLL_CTL_DEL;
+	else
+		op = EPOLL_CTL_MOD;
+
+	ev.events = events;
+	ev.data.ptr = ep;
+	if (epoll_ctl(c->epfd, op, ep->fd, &ev) < 0)
+		LOG(LOG_ERROR, "msg=\"epoll_ctl error\" error=\"%s\"", strerror(errno));
+	ep->events = events;
+}
+
+static void conn_close(conn_t *c) {
+	if (c->start) {
+		stats_time(TIMER_TOTAL, c->start);
+		LOG(LOG_INFO, "event=access url=%s result=%s bytes=%llu us=%llu", c->cache_index, c->result,
+			c->sent, (stats_now() - c->start) / 1000);
+	}
+	stats_add(STAT_CONN_CLOSED, 1);
+	if (c->client.fd >= 0)
+		close(c->client.fd);
+	if (c->server.fd >= 0)
+		close(c->server.fd);
+	if (c->hit)
+		cache_release(c->hit);
+	buf_put(c->io);
+	free(c->request);
+	free(c->cache_index);
+	chain_free(&c->copy);
+	free(c);
+}
+
+static void on_event(endpoint_t *ep, unsigned int events) {
+	conn_t *c = ep->conn;
+
+	/* Errors and hangups surface through the next read/write call. */
+	switch (c->state) {
+	case ST_READ_REQUEST:
+		read_request_bytes(c);
+		break;
+	case ST_CONNECT:
+	case ST_SEND_REQUEST:
+		send_request(c);
+		break;
+	case ST_RELAY:
+		if (ep == &c->server)
+			relay_response(c);
+		else
+			flush_client(c);
+		break;
+	case ST_RESPOND:
+		flush_client(c);
+		break;
+	}
+}
+
+static void read_request_bytes(conn_t *c) {
+	HttpRequest req;
+	ssize_t n;
+	int rc;
+	Buf *b;
+
+	if (!c->io) {
+		c->io = buf_get(MIN_REQUEST);
+		c->buf = c->io->data;
+	}
+
+	while (1) {
+		if (c->len + 1 >= c->io->size) {
+			if (c->io->size >= MAX_REQUEST) {
+				conn_close(c);
+				return;
+			}
+			b = buf_get(c->io->size * 2);
+			memcpy(b->data, c->buf, c->len);
+			buf_put(c->io);
+			c->io = b;
+			c->buf = b->data;
+		}
+		n = read(c->client.fd, c->buf + c->len, c->io->size - c->len - 1);
+		if (n > 0) {
+			c->len += n;
+			c->buf[c->len] = '\0';
+			if ((rc = http_parse_request(c->buf, c->len, &req)) != -2) {
+				if (rc == -1)
+					conn_close(c);
+				else
+					process_request(c, &req);
+				return;
+			}
+		}
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		else if (n < 0 && errno == EINTR)
+			continue;
+		else {
+			conn_close(c);
+			return;
+		}
+	}
+}
+
+/* process_request - rewrite the buffered request and look it up in the cache */
+static void process_request(conn_t *c, HttpRequest *req) {
+	char request[MAXBUF];
+	char host[MAXBUF], port[MAXBUF], resource[MAXBUF], cache_index[MAXBUF];
+	time_t now = time(NULL), expires;
+	HttpOut out;
+	Buf *page;
+	int len;
+
+	if (http_rewrite_request(req, &out, host, port, resource, 0) != 0 ||
+			http_join(&out, request, sizeof(request)) == -1) {
+		conn_close(c);
+		return;
+	}
+	make_cache_index(cache_index, host, port, resource);
+
+	watch(c, &c->client, 0);
+
+	/* the proxy's own stats page, asked for in origin form */
+	if (http_own_path(req, resource, STATS_PATH)) {
+		page = buf_get(2 * MAXBUF);
+		respond(c, page, page->data,
+			stats_page(page->data, 2 * MAXBUF, strstr(resource, "json") != NULL, close_connection));
+		return;
+	}
+
+	c->cache_index = strdup(cache_index);
+	c->start = stats_now();
+	stats_add(STAT_REQUESTS, 1);
+	procs_add(0, 1);
+
+	/* a stale hit is fetched again in full; this mode does not revalidate */
+	if ((c->hit = cache_lookup(list, cache_index)) != NULL && !cache_fresh(c->hit, now)) {
+		cache_release(c->hit);
+		c->hit = NULL;
+	}
+	if (!c->hit && shared_cache) {
+		page = buf_get(MAX_OBJECT_SIZE);
+		len = shm_get(shared_cache, cache_index, cache_hash(cache_index), page->data, MAX_OBJECT_SIZE, &expires);
+		if (len >= 0 && expires > now) {
+			stats_time(TIMER_LOOKUP, c->start);
+			stats_add(STAT_SHARED_HITS, 1);
+			stats_add(STAT_BYTES_OUT, len);
+			stats_add(STAT_BYTES_HIT, len);
+			c->sent = len;
+			c->result = "shared";
+			insert_content_node(list, cache_index, page->data, len, expires);
+			respond(c, page, page->data, len);
+			return;
+		}
+		buf_put(page);
+	}
+	stats_time(TIMER_LOOKUP, c->start);
+	stats_add(c->hit ? STAT_HITS : STAT_MISSES, 1);
+	c->result = c->hit ? "hit" : "miss";
+	/* a hit is written straight from the cached object */
+	if (c->hit) {
+		stats_add(STAT_BYTES_OUT, c->hit->length);
+		stats_add(STAT_BYTES_HIT, c->hit->length);
+		c->sent = c->hit->length;
+		buf_put(c->io);
+		c->io = NULL;
+		c->buf = c->hit->data;
+		c->len = c->hit->length;
+		c->off = 0;
+		c->state = ST_RESPOND;
+		flush_client(c);
+		return;
+	}
+
+	c->copying = 1;
+	c->credentials = http_credentials(req);
+	c->request = strdup(request);
+	start_connect(c, host, port);
+}
+
+/*
+ * start_connect - begin a non-blocking connect to the server.
+ * A DNS cache miss still blocks the loop for the resolver call.
+ */
+static void start_connect(conn_t *c, char *host, char *port) {
+	struct sockaddr_in addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(port));
+	c->mark = stats_now();
+	if (dns_lookup(&dns, host, &addr.sin_addr) < 0) {
+		LOG(LOG_WARN, "msg=\"dns lookup failed\" host=%s", host);
+		stats_add(STAT_ERRORS, 1);
+		c->result = "error";
+		respond(c, NULL, (char *)fail_str, strlen(fail_str));
+		return;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0 || (connect(fd, (SA *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)) {
+		if (fd >= 0)
+			close(fd);
+		LOG(LOG_WARN, "msg=\"forward content to server error\" url=%s", c->cache_index);
+		stats_add(STAT_ERRORS, 1);
+		c->result = "error";
+		respond(c, NULL, (char *)fail_str, strlen(fail_str));
+		return;
+	}
+	c->server.fd = fd;
+	c->state = ST_CONNECT;
+	watch(c, &c->server, EPOLLOUT);
+}
+
+static void send_request(conn_t *c) {
+	unsigned int len = strlen(c->request);
+	socklen_t errlen = sizeof(int);
+	int err = 0;
+	ssize_t n;
+
+	if (c->state == ST_CONNECT) {
+		if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err) {
+			LOG(LOG_WARN, "msg=\"forward content to server error\" url=%s", c->cache_index);
+			stats_add(STAT_ERRORS, 1);
+			c->result = "error";
+			watch(c, &c->server, 0);
+			respond(c, NULL, (char *)fail_str, strlen(fail_str));
+			return;
+		}
+		stats_time(TIMER_CONNECT, c->mark);
+		LOG(LOG_DEBUG, "event=upstream fd=%d us=%llu", c->server.fd, (stats_now() - c->mark) / 1000);
+		c->state = ST_SEND_REQUEST;
+		c->off = 0;
+	}
+
+	while (c->off < len) {
+		n = write(c->server.fd, c->request + c->off, len - c->off);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			conn_close(c);
+			return;
+		}
+		c->off += n;
+	}
+
+	free(c->request);
+	c->request = NULL;
+	/* the request buffer becomes the relay buffer */
+	if (c->io->size < MAXBUF) {
+		buf_put(c->io);
+		c->io = buf_get(MAXBUF);
+		c->buf = c->io->data;
+	}
+	c->len = c->off = 0;
+	c->mark = stats_now();
+	c->state = ST_RELAY;
+	watch(c, &c->server, EPOLLIN);
+}
+
+/* relay_response - read a chunk from the server and pass it to the client */
+static void relay_response(conn_t *c) {
+	struct iovec iov[CHAIN_MAX_IOV];
+	time_t expires;
+	int iovcnt;
+	ssize_t n;
+
+	while ((n = read(c->server.fd, c->buf, c->io->size)) < 0 && errno == EINTR)
+		;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (n <= 0) {
+		/* The server closed the connection: the response is complete. */
+		if (n == 0 && c->copying && c->copy.len) {
+			/* the header nearly always fits the first buffer; else gather up to MAXBUF of it */
+			expires = http_expires(c->copy.first->data, c->copy.first->len, time(NULL));
+			if (expires == -1 && c->copy.first->len < c->copy.len && c->copy.first->len < MAXBUF)
+				expires = http_expires(chain_pullup(&c->copy, MAXBUF),
+					c->copy.len < MAXBUF ? c->copy.len : MAXBUF, time(NULL));
+			/* either way the header is in the first buffer now */
+			if (expires != -1 && c->credentials && !http_public(c->copy.first->data, c->copy.first->len))
+				expires = -1;
+			iovcnt = chain_iov(&c->copy, iov, CHAIN_MAX_IOV);
+			if (expires != -1 && iovcnt != -1 && shared_cache)
+				shm_put(shared_cache, c->cache_index, cache_hash(c->cache_index), iov, iovcnt, expires);
+			if (expires != -1 && iovcnt != -1 &&
+					insert_content_iov(list, c->cache_index, iov, iovcnt, expires) == -1)
+				LOG(LOG_WARN, "msg=\"save content to cache error\" url=%s", c->cache_index);
+		}
+		conn_close(c);
+		return;
+	}
+
+	if (c->mark) {
+		stats_time(TIMER_TTFB, c->mark);
+		c->mark = 0;
+	}
+	stats_add(STAT_BYTES_IN, n);
+	stats_add(STAT_BYTES_OUT, n);
+	c->sent += n;
+
+	if (c->copying) {
+		if (c->copy.len + n <= MAX_OBJECT_SIZE)
+			chain_append(&c->copy, c->buf, n);
+		else {
+			chain_free(&c->copy);
+			c->copying = 0;
+		}
+	}
+
+	c->len = n;
+	c->off = 0;
+	flush_client(c);
+}
+
+/*
+ * flush_client - write pending bytes to the client. While the client is
+ * slow, stop reading from the server; resume once the buffer drained.
+ */
+static void flush_client(conn_t *c) {
+	ssize_t n;
+
+	while (c->off < c->len) {
+		n = write(c->client.fd, c->buf + c->off, c->len - c->off);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (c->state == ST_RELAY)
+				watch(c, &c->server, 0);
+			watch(c, &c->client, EPOLLOUT);
+			return;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (c->start) {
+				LOG(LOG_WARN, "msg=\"forward content to client error\" url=%s", c->cache_index);
+				c->result = "error";
+			}
+			conn_close(c);
+			return;
+		}
+		c->off += n;
+	}
+
+	if (c->state == ST_RESPOND) {
+		conn_close(c);
+		return;
+	}
+	watch(c, &c->client, 0);
+	watch(c, &c->server, EPOLLIN);
+}
+
+/*
+ * respond - send len bytes at data to the client and close. b, if not
+ * NULL, holds them and is put back with the connection.
+ */
+static void respond(conn_t *c, Buf *b, char *data, unsigned int len) {
+	buf_put(c->io);
+	c->io = b;
+	c->buf = data;
+	c->len = len;
+	c->off = 0;
+	c->state = ST_RESPOND;
+	flush_client(c);
+}
@@ -0,0 +1,6 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_loop_run(int listenfd, int nloops);
+
+#endif
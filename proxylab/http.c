@@ -0,0 +1,600 @@
+/*
+ * http.c - request parsing and rewriting shared by the thread and event modes.
+ *
+ * http_parse_request scans a buffer for line ends with memchr and records
+ * the request line and every header as spans into that buffer, without
+ * copying or NUL-terminating anything. It can be called again on the same
+ * buffer as more bytes arrive. http_rewrite_request turns the spans into
+ * the request sent upstream as an iovec: the proxy's own lines plus the
+ * client's header lines it keeps, written with one writev.
+ *
+ * For cached responses, http_expires works out how long a response stays
+ * fresh (RFC 7234: Cache-Control, Expires, Date and Age, else a heuristic
+ * from Last-Modified) and http_add_validators turns a forwarded request
+ * into a revalidation with the stored ETag and Last-Modified.
+ */
+#define _GNU_SOURCE
+#include "http.h"
+
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_str = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding = "Accept-Encoding: gzip, deflate\r\n";
+
+static const char *connection = "Connection: close\r\n";
+static const char *proxy_connection = "Proxy-Connection: close\r\n";
+static const char *init_version = "HTTP/1.0\r\n";
+static const char *keep_alive_version = "HTTP/1.1\r\n";
+const char *keep_alive_connection = "Connection: keep-alive\r\n";
+const char *close_connection = "Connection: close\r\n";
+
+/* client headers replaced by the proxy's own */
+static const struct {
+	const char *name;
+	unsigned int len;
+} replaced[] = {
+	{"User-Agent", 10}, {"Accept", 6}, {"Accept-Encoding", 15}, {"Connection", 10},
+	{"Proxy-Connection", 16}, {"Keep-Alive", 10}, {"Cookie", 6}, {"Host", 4},
+	/* the proxy fetches whole responses it can cache and revalidates them itself */
+	{"If-None-Match", 13}, {"If-Modified-Since", 17}, {"If-Match", 8},
+	{"If-Unmodified-Since", 19}, {"If-Range", 8}, {NULL, 0}
+};
+
+/* response codes cacheable by default (RFC 7231 section 6.1), less 204 and 206 */
+static const int storable[] = {200, 203, 300, 301, 404, 405, 410, 414, 501, 0};
+
+/* Cache-Control directives that matter to a shared cache; -1 if absent */
+typedef struct Directives {
+	int no_store;
+	int no_cache;
+	int public;
+	int must_revalidate;
+	long max_age;
+	long s_maxage;
+} Directives;
+
+static int span_is(HttpSpan *s, const char *name);
+static int span_copy(HttpSpan *s, char *dst, unsigned int size);
+static int replaced_header(HttpHeader *h);
+static void add_iov(HttpOut *out, const char *p, unsigned int len);
+static int response_header(char *resp, unsigned int head, const char *name, int n, HttpSpan *value);
+static time_t parse_date(HttpSpan *s);
+static void cache_control(char *resp, unsigned int head, Directives *d);
+static int freshness(char *resp, unsigned int head, time_t now, long *lifetime, long *age);
+
+/* span_is - case-insensitive comparison with a NUL-terminated name */
+static int span_is(HttpSpan *s, const char *name) {
+	size_t len = strlen(name);
+
+	return s->len == len && !strncasecmp(s->p, name, len);
+}
+
+/* span_copy - NUL-terminated copy of s; -1 if it does not fit */
+static int span_copy(HttpSpan *s, char *dst, unsigned int size) {
+	if (s->len >= size)
+		return -1;
+	memcpy(dst, s->p, s->len);
+	dst[s->len] = '\0';
+	return 0;
+}
+
+static int replaced_header(HttpHeader *h) {
+	int i;
+
+	for (i = 0; replaced[i].name; i++)
+		if (h->name.len == replaced[i].len && !strncasecmp(h->name.p, replaced[i].name, replaced[i].len))
+			return 1;
+	return 0;
+}
+
+/* add_iov - append a range, growing the last entry if the range follows it */
+static void add_iov(HttpOut *out, const char *p, unsigned int len) {
+	struct iovec *last = out->iovcnt ? &out->iov[out->iovcnt - 1] : NULL;
+
+	if (last && (char *)last->iov_base + last->iov_len == p)
+		last->iov_len += len;
+	else {
+		out->iov[out->iovcnt].iov_base = (void *)p;
+		out->iov[out->iovcnt].iov_len = len;
+		out->iovcnt++;
+	}
+}
+
+/*
+ * http_parse_request - parse the request line and headers in buf[0..len).
+ * Lines may end in CRLF or a bare LF. Returns the length of the request
+ * header, blank line included, -2 if buf does not hold all of it yet and
+ * -1 for a malformed request.
+ */
+int http_parse_request(char *buf, unsigned int len, HttpRequest *req) {
+	char *p = buf, *end = buf + len, *eol, *line_end, *sp, *colon;
+	HttpHeader *h;
+
+	req->nheaders = 0;
+
+	if (!(eol = memchr(p, '\n', len)))
+		return -2;
+	line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+
+	/* METHOD SP target SP HTTP/1.x */
+	if (!(sp = memchr(p, ' ', line_end - p)) || sp == p)
+		return -1;
+	req->method.p = p;
+	req->method.len = sp - p;
+	p = sp + 1;
+	if (!(sp = memchr(p, ' ', line_end - p)) || sp == p)
+		return -1;
+	req->target.p = p;
+	req->target.len = sp - p;
+	p = sp + 1;
+	if (line_end - p != 8 || memcmp(p, "HTTP/1.", 7) || !isdigit((unsigned char)p[7]))
+		return -1;
+	req->minor = p[7] - '0';
+
+	for (p = eol + 1; ; p = eol + 1) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			return -2;
+		line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+		if (line_end == p) {
+			req->length = eol + 1 - buf;
+			return req->length;
+		}
+		if (req->nheaders == HTTP_MAX_HEADERS)
+			return -1;
+		if (!(colon = memchr(p, ':', line_end - p)) || colon == p)
+			return -1;
+
+		h = &req->headers[req->nheaders++];
+		h->name.p = p;
+		h->name.len = colon - p;
+		for (colon++; colon < line_end && (*colon == ' ' || *colon == '\t'); colon++)
+			;
+		while (line_end > colon && (line_end[-1] == ' ' || line_end[-1] == '\t'))
+			line_end--;
+		h->value.p = colon;
+		h->value.len = line_end - colon;
+		h->line.p = p;
+		h->line.len = eol + 1 - p;
+	}
+}
+
+/*
+ * http_read_request - parse the next request straight out of rp's buffer,
+ * reading more from the descriptor until the header is complete. The
+ * header is consumed from rp; spans in req stay valid until rp is read
+ * again. Returns the header length, or -1 on EOF, errors (including a
+ * timeout) and requests that are malformed or longer than RIO_BUFSIZE.
+ */
+int http_read_request(rio_t *rp, HttpRequest *req) {
+	ssize_t n;
+	int rc;
+
+	if (rp->rio_cnt <= 0) {
+		rp->rio_cnt = 0;
+		rp->rio_bufptr = rp->rio_buf;
+	}
+	while ((rc = http_parse_request(rp->rio_bufptr, rp->rio_cnt, req)) == -2) {
+		if (rp->rio_bufptr != rp->rio_buf) {
+			memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+			rp->rio_bufptr = rp->rio_buf;
+		}
+		if (rp->rio_cnt == RIO_BUFSIZE)
+			return -1;
+		n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		rp->rio_cnt += n;
+	}
+	if (rc < 0)
+		return -1;
+	rp->rio_bufptr += rc;
+	rp->rio_cnt -= rc;
+	return rc;
+}
+
+HttpHeader *http_find_header(HttpRequest *req, const char *name) {
+	int i;
+
+	for (i = 0; i < req->nheaders; i++)
+		if (span_is(&req->headers[i].name, name))
+			return &req->headers[i];
+	return NULL;
+}
+
+/* http_credentials - whether req carries Authorization or Cookie, making the response its own */
+int http_credentials(HttpRequest *req) {
+	return http_find_header(req, "Authorization") || http_find_header(req, "Cookie");
+}
+
+/*
+ * http_keep_alive - whether the client wants the connection kept open:
+ * HTTP/1.1 unless it sent Connection: close, HTTP/1.0 only with
+ * Connection: keep-alive.
+ */
+int http_keep_alive(HttpRequest *req) {
+	char value[MAXLINE];
+	int keep_alive = (req->minor >= 1), i;
+	HttpHeader *h;
+
+	for (i = 0; i < req->nheaders; i++) {
+		h = &req->headers[i];
+		if (!span_is(&h->name, "Connection") && !span_is(&h->name, "Proxy-Connection"))
+			continue;
+		if (span_copy(&h->value, value, sizeof(value)) == -1)
+			continue;
+		if (strcasestr(value, "close"))
+			keep_alive = 0;
+		else if (strcasestr(value, "keep-alive"))
+			keep_alive = 1;
+	}
+	return keep_alive;
+}
+
+/*
+ * http_rewrite_request - find the origin and resource of req and build the
+ * forwarded request in out. With keep_alive the request is sent as
+ * HTTP/1.1 on a persistent connection, otherwise as HTTP/1.0 with
+ * Connection: close. out refers to req's buffer, so it is only valid as
+ * long as req is.
+ * Returns 0 for GET, 1 for other methods and -1 for a malformed request.
+ */
+int http_rewrite_request(HttpRequest *req, HttpOut *out, char *host, char *port, char *resource, int keep_alive) {
+	char host_port[MAXLINE];
+	char *p = req->target.p, *end = p + req->target.len, *slash, *w;
+	const char *version = keep_alive ? keep_alive_version : init_version;
+	HttpSpan hp = {p, 0}, res = {"/", 1};
+	HttpHeader *h;
+	unsigned int hlen, plen, n;
+	int i;
+
+	/* absolute-form "scheme://host[:port]/path", authority "host[:port]" or origin-form "/path" */
+	if (p < end && *p != '/' && (slash = memmem(p, end - p, "://", 3)) != NULL)
+		p = hp.p = slash + 3;
+	if (p < end && *p != '/') {
+		slash = memchr(p, '/', end - p);
+		hp.len = (slash ? slash : end) - p;
+		p += hp.len;
+	}
+	if (p < end) {
+		res.p = p;
+		res.len = end - p;
+	}
+	if (span_copy(&res, resource, MAXLINE) == -1)
+		return -1;
+
+	if (!hp.len && (h = http_find_header(req, "Host")))
+		hp = h->value;
+	if (span_copy(&hp, host_port, sizeof(host_port)) == -1)
+		return -1;
+	get_host_and_port(host_port, host, port);
+
+	if (req->method.len != 3 || memcmp(req->method.p, "GET", 3))
+		return 1;
+
+	/* "GET <resource> HTTP/1.x\r\n" and "Host: <host>:<port>\r\n" */
+	hlen = strlen(host);
+	plen = strlen(port);
+	n = 4 + res.len + 1 + strlen(version) + (hlen ? 6 + hlen + 1 + plen + 2 : 0);
+	if (n >= sizeof(out->line))
+		return -1;
+	w = out->line;
+	memcpy(w, "GET ", 4);
+	memcpy(w += 4, res.p, res.len);
+	*(w += res.len) = ' ';
+	memcpy(++w, version, strlen(version));
+	w += strlen(version);
+	if (hlen) {
+		memcpy(w, "Host: ", 6);
+		memcpy(w += 6, host, hlen);
+		*(w += hlen) = ':';
+		memcpy(++w, port, plen);
+		memcpy(w += plen, "\r\n", 2);
+	}
+
+	out->iovcnt = 0;
+	add_iov(out, out->line, n);
+	add_iov(out, user_agent_hdr, strlen(user_agent_hdr));
+	add_iov(out, accept_str, strlen(accept_str));
+	add_iov(out, accept_encoding, strlen(accept_encoding));
+	if (keep_alive)
+		add_iov(out, keep_alive_connection, strlen(keep_alive_connection));
+	else {
+		add_iov(out, connection, strlen(connection));
+		add_iov(out, proxy_connection, strlen(proxy_connection));
+	}
+	/* kept headers are consecutive lines of req's buffer and merge into one entry */
+	for (i = 0; i < req->nheaders; i++)
+		if (!replaced_header(&req->headers[i]))
+			add_iov(out, req->headers[i].line.p, req->headers[i].line.len);
+	add_iov(out, "\r\n", 2);
+	return 0;
+}
+
+/* http_join - copy the rewritten request into buf as a string; -1 if it does not fit */
+int http_join(HttpOut *out, char *buf, unsigned int size) {
+	unsigned int len = 0;
+	int i;
+
+	for (i = 0; i < out->iovcnt; i++) {
+		if (len + out->iov[i].iov_len >= size)
+			return -1;
+		memcpy(buf + len, out->iov[i].iov_base, out->iov[i].iov_len);
+		len += out->iov[i].iov_len;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * http_own_path - whether req asks the proxy itself (origin form) for
+ * path, given the resource http_rewrite_request found; a query may follow.
+ */
+int http_own_path(HttpRequest *req, char *resource, const char *path) {
+	size_t len = strlen(path);
+
+	return req->target.p[0] == '/' && !strncmp(resource, path, len) &&
+		(!resource[len] || resource[len] == '?');
+}
+
+/*
+ * http_writev - write all of iov, resuming after short writes. iov itself
+ * is left untouched so the same request can be sent again.
+ */
+ssize_t http_writev(int fd, struct iovec *iov, int iovcnt) {
+	struct iovec v[HTTP_MAX_IOV], *p = v;
+	ssize_t n, total = 0;
+
+	if (iovcnt > HTTP_MAX_IOV)
+		return -1;
+	memcpy(v, iov, iovcnt * sizeof(*v));
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, p, iovcnt)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += n;
+		while (iovcnt > 0 && (size_t)n >= p->iov_len) {
+			n -= p->iov_len;
+			p++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			p->iov_base = (char *)p->iov_base + n;
+			p->iov_len -= n;
+		}
+	}
+	return total;
+}
+
+/*
+ * http_response_head - length of the response header in resp[0..len),
+ * blank line included, or -1 if it is not all there.
+ */
+int http_response_head(char *resp, unsigned int len) {
+	char *p = resp, *end = resp + len, *eol;
+
+	for (; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1)
+		if (eol == p || (eol == p + 1 && *p == '\r'))
+			return eol + 1 - resp;
+	return -1;
+}
+
+/* response_header - value of the n-th header called name in resp[0..head), trimmed */
+static int response_header(char *resp, unsigned int head, const char *name, int n, HttpSpan *value) {
+	char *p = resp, *end = resp + head, *eol, *v, *e;
+	size_t len = strlen(name);
+
+	if (!(eol = memchr(p, '\n', head)))
+		return 0;
+	for (p = eol + 1; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1) {
+		if ((size_t)(eol - p) <= len || p[len] != ':' || strncasecmp(p, name, len) || n-- > 0)
+			continue;
+		for (v = p + len + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+			;
+		for (e = eol; e > v && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t'); e--)
+			;
+		value->p = v;
+		value->len = e - v;
+		return 1;
+	}
+	return 0;
+}
+
+/* parse_date - an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"); -1 if invalid */
+static time_t parse_date(HttpSpan *s) {
+	char buf[64], *end;
+	struct tm tm;
+
+	if (span_copy(s, buf, sizeof(buf)) == -1)
+		return -1;
+	memset(&tm, 0, sizeof(tm));
+	if (!(end = strptime(buf, "%a, %d %b %Y %H:%M:%S", &tm)) || strncmp(end, " GMT", 4))
+		return -1;
+	return timegm(&tm);
+}
+
+static void cache_control(char *resp, unsigned int head, Directives *d) {
+	char value[MAXLINE], *tok, *save;
+	HttpSpan v;
+	int n;
+
+	d->no_store = d->no_cache = d->public = d->must_revalidate = 0;
+	d->max_age = d->s_maxage = -1;
+	for (n = 0; response_header(resp, head, "Cache-Control", n, &v); n++) {
+		if (span_copy(&v, value, sizeof(value)) == -1)
+			continue;
+		for (tok = strtok_r(value, ", ", &save); tok; tok = strtok_r(NULL, ", ", &save)) {
+			if (!strcasecmp(tok, "no-store") || !strncasecmp(tok, "private", 7))
+				d->no_store = 1;
+			else if (!strncasecmp(tok, "no-cache", 8))
+				d->no_cache = 1;
+			else if (!strcasecmp(tok, "public"))
+				d->public = 1;
+			else if (!strcasecmp(tok, "must-revalidate"))
+				d->must_revalidate = 1;
+			else if (!strncasecmp(tok, "max-age=", 8))
+				d->max_age = strtol(tok + 8, NULL, 10);
+			else if (!strncasecmp(tok, "s-maxage=", 9))
+				d->s_maxage = strtol(tok + 9, NULL, 10);
+		}
+	}
+	if (n == 0 && response_header(resp, head, "Pragma", 0, &v) &&
+			v.len >= 8 && !strncasecmp(v.p, "no-cache", 8))
+		d->no_cache = 1;
+}
+
+/*
+ * freshness - freshness lifetime and current age of the response in
+ * resp[0..head). Returns -1 if a shared cache must not store it, 1 if the
+ * lifetime is explicit and 0 if it is a heuristic.
+ */
+static int freshness(char *resp, unsigned int head, time_t now, long *lifetime, long *age) {
+	time_t date, expires, modified;
+	Directives d;
+	HttpSpan v;
+	int explicit = 1;
+
+	cache_control(resp, head, &d);
+	if (d.no_store)
+		return -1;
+
+	if (!response_header(resp, head, "Date", 0, &v) || (date = parse_date(&v)) == -1)
+		date = now;
+	*age = now > date ? now - date : 0;
+	if (response_header(resp, head, "Age", 0, &v))
+		*age += strtol(v.p, NULL, 10);
+
+	if (d.no_cache)
+		*lifetime = 0;
+	else if (d.s_maxage >= 0)
+		*lifetime = d.s_maxage;
+	else if (d.max_age >= 0)
+		*lifetime = d.max_age;
+	else if (response_header(resp, head, "Expires", 0, &v))
+		/* an invalid date, such as "0", means already expired */
+		*lifetime = (expires = parse_date(&v)) > date ? expires - date : 0;
+	else {
+		explicit = 0;
+		if (response_header(resp, head, "Last-Modified", 0, &v) && (modified = parse_date(&v)) != -1)
+			*lifetime = modified < date ? (date - modified) / 10 : 0;
+		else
+			*lifetime = HTTP_DEFAULT_TTL;
+		if (*lifetime > HTTP_HEURISTIC_MAX)
+			*lifetime = HTTP_HEURISTIC_MAX;
+	}
+	return explicit;
+}
+
+/*
+ * http_expires - when the response in resp[0..len) stops being fresh, or
+ * -1 if it must not be cached: a status that is not cacheable by default,
+ * Cache-Control no-store or private, or an incomplete header. A response
+ * that must always be revalidated expires now.
+ */
+time_t http_expires(char *resp, unsigned int len, time_t now) {
+	long lifetime, age;
+	int head, status = 0, i;
+
+	if ((head = http_response_head(resp, len)) == -1 || sscanf(resp, "HTTP/1.%*d %d", &status) != 1)
+		return -1;
+	for (i = 0; storable[i] && storable[i] != status; i++)
+		;
+	if (!storable[i] || freshness(resp, head, now, &lifetime, &age) == -1)
+		return -1;
+	return now + (lifetime > age ? lifetime - age : 0);
+}
+
+/*
+ * http_public - whether the response in resp[0..len) may be stored by a
+ * shared cache although the request carried credentials: Cache-Control
+ * public, s-maxage or must-revalidate (RFC 7234 3.2).
+ */
+int http_public(char *resp, unsigned int len) {
+	Directives d;
+	int head;
+
+	if ((head = http_response_head(resp, len)) == -1)
+		return 0;
+	cache_control(resp, head, &d);
+	return d.public || d.must_revalidate || d.s_maxage >= 0;
+}
+
+/*
+ * http_refresh - new expiry for stored after the 304 resp[0..len). The 304
+ * decides if it carries Cache-Control or Expires; otherwise the stored
+ * response's lifetime starts over now. Returns now if neither allows
+ * storing.
+ */
+time_t http_refresh(char *resp, unsigned int len, char *stored, unsigned int stored_len, time_t now) {
+	long lifetime, age;
+	int head, r;
+
+	if ((head = http_response_head(resp, len)) == -1 ||
+			(r = freshness(resp, head, now, &lifetime, &age)) == -1)
+		return now;
+	if (r == 1)
+		return now + (lifetime > age ? lifetime - age : 0);
+	if ((head = http_response_head(stored, stored_len)) == -1 ||
+			freshness(stored, head, now, &lifetime, &age) == -1)
+		return now;
+	return now + lifetime;
+}
+
+/*
+ * http_add_validators - make out a conditional request for the stored
+ * response resp[0..len): If-None-Match with its ETag, If-Modified-Since
+ * with its Last-Modified. The lines are written to buf, which must live as
+ * long as out. Returns 0 if resp has neither validator (or they do not
+ * fit), else the number of lines added.
+ */
+int http_add_validators(HttpOut *out, char *resp, unsigned int len, char *buf, unsigned int size) {
+	struct iovec *last;
+	HttpSpan etag, modified;
+	int head, has_etag, has_modified, n;
+
+	if ((head = http_response_head(resp, len)) == -1 || !out->iovcnt || out->iovcnt + 2 > HTTP_MAX_IOV)
+		return 0;
+	has_etag = response_header(resp, head, "ETag", 0, &etag);
+	has_modified = response_header(resp, head, "Last-Modified", 0, &modified);
+	if (!has_etag && !has_modified)
+		return 0;
+	if (has_etag && has_modified)
+		n = snprintf(buf, size, "If-None-Match: %.*s\r\nIf-Modified-Since: %.*s\r\n",
+			etag.len, etag.p, modified.len, modified.p);
+	else if (has_etag)
+		n = snprintf(buf, size, "If-None-Match: %.*s\r\n", etag.len, etag.p);
+	else
+		n = snprintf(buf, size, "If-Modified-Since: %.*s\r\n", modified.len, modified.p);
+	if (n < 0 || (unsigned int)n >= size)
+		return 0;
+
+	/* the lines go in front of the blank line that ends out */
+	last = &out->iov[out->iovcnt - 1];
+	if ((last->iov_len -= 2) == 0)
+		out->iovcnt--;
+	add_iov(out, buf, n);
+	add_iov(out, "\r\n", 2);
+	return has_etag + has_modified;
+}
+
+void make_cache_index(char *cache_index, char *host, char *port, char *resource) {
+	strcpy(cache_index, host);
+	strcat(cache_index, ":");
+	strcat(cache_index, port);
+	strcat(cache_index, resource);
+}
+
+void get_host_and_port(char *host_port, char *host, char *port){
+	char *tmpstr = strstr(host_port,":");
+	if (tmpstr) {
+		*tmpstr = '\0';
+		strcpy(port, tmpstr + 1);
+	}
+	else
+		strcpy(port, "80");
+
+	strcpy(host, host_port);
+}
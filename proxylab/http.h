@@ -0,0 +1,64 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <sys/uio.h>
+#include <time.h>
+
+#include "csapp.h"
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_IOV (HTTP_MAX_HEADERS + 10)
+#define HTTP_DEFAULT_TTL 300		/* seconds fresh without Cache-Control, Expires or Last-Modified */
+#define HTTP_HEURISTIC_MAX 86400	/* cap on a heuristic lifetime */
+
+/* a byte range inside the buffer the request was parsed from; not NUL-terminated */
+typedef struct HttpSpan {
+	char *p;
+	unsigned int len;
+} HttpSpan;
+
+typedef struct HttpHeader {
+	HttpSpan name;
+	HttpSpan value;		/* without surrounding whitespace */
+	HttpSpan line;		/* the whole line, CRLF included */
+} HttpHeader;
+
+typedef struct HttpRequest {
+	HttpSpan method;
+	HttpSpan target;
+	int minor;			/* HTTP/1.<minor> */
+	int nheaders;
+	HttpHeader headers[HTTP_MAX_HEADERS];
+	unsigned int length;	/* request line and headers, blank line included */
+} HttpRequest;
+
+/* the rewritten request: fixed strings, spans of the client's request and line */
+typedef struct HttpOut {
+	struct iovec iov[HTTP_MAX_IOV];
+	int iovcnt;
+	char line[MAXLINE];	/* request line and Host header */
+} HttpOut;
+
+extern const char *keep_alive_connection;
+extern const char *close_connection;
+
+int http_parse_request(char *buf, unsigned int len, HttpRequest *req);
+int http_read_request(rio_t *rp, HttpRequest *req);
+HttpHeader *http_find_header(HttpRequest *req, const char *name);
+int http_keep_alive(HttpRequest *req);
+int http_credentials(HttpRequest *req);
+int http_rewrite_request(HttpRequest *req, HttpOut *out, char *host, char *port, char *resource, int keep_alive);
+int http_join(HttpOut *out, char *buf, unsigned int size);
+int http_own_path(HttpRequest *req, char *resource, const char *path);
+ssize_t http_writev(int fd, struct iovec *iov, int iovcnt);
+
+int http_response_head(char *resp, unsigned int len);
+time_t http_expires(char *resp, unsigned int len, time_t now);
+int http_public(char *resp, unsigned int len);
+time_t http_refresh(char *resp, unsigned int len, char *stored, unsigned int stored_len, time_t now);
+int http_add_validators(HttpOut *out, char *resp, unsigned int len, char *buf, unsigned int size);
+
+void make_cache_index(char *cache_index, char *host, char *port, char *resource);
+void get_host_and_port(char *host_port, char *host, char *port);
+
+#endif
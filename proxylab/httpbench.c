@@ -0,0 +1,183 @@
+/*
+ * httpbench.c - request parsing throughput over request corpora.
+ *
+ * A corpus file holds raw requests back to back, as a client pipelining
+ * them would send. Each round runs every request through
+ *
+ *   parse    http_parse_request alone
+ *   rewrite  http_parse_request and http_rewrite_request, as read_request does
+ *   legacy   the line-at-a-time path read_request used before: one
+ *            function call per byte to find the line end, then the
+ *            forwarded request rebuilt with strcat and strstr
+ *
+ * usage: httpbench [-n rounds] corpus...
+ */
+#include <getopt.h>
+#include <time.h>
+
+#include "http.h"
+
+static const char *legacy_fixed = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Connection: keep-alive\r\n";
+
+typedef struct {
+	char *data;
+	unsigned int len;
+} request_t;
+
+static request_t *reqs;
+static int nreqs;
+static unsigned long corpus_bytes;
+
+static void usage(void) {
+	fprintf(stderr, "usage: httpbench [-n rounds] corpus...\n");
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* load_corpus - split a file of back-to-back requests into reqs */
+static void load_corpus(char *path) {
+	HttpRequest req;
+	struct stat st;
+	char *data;
+	unsigned int off = 0;
+	int fd, rc;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "cannot read %s\n", path);
+		exit(1);
+	}
+	data = Malloc(st.st_size);
+	if (rio_readn(fd, data, st.st_size) != st.st_size) {
+		fprintf(stderr, "cannot read %s\n", path);
+		exit(1);
+	}
+	close(fd);
+
+	while (off < st.st_size) {
+		if ((rc = http_parse_request(data + off, st.st_size - off, &req)) < 0) {
+			fprintf(stderr, "%s: malformed request at byte %u\n", path, off);
+			exit(1);
+		}
+		reqs = Realloc(reqs, (nreqs + 1) * sizeof(request_t));
+		reqs[nreqs].data = data + off;
+		reqs[nreqs].len = rc;
+		nreqs++;
+		corpus_bytes += rc;
+		off += rc;
+	}
+}
+
+/* one call per byte, like rio_readlineb calling rio_read(rp, &c, 1) */
+static int __attribute__((noinline)) legacy_getc(request_t *r, unsigned int *off) {
+	return *off < r->len ? (unsigned char)r->data[(*off)++] : -1;
+}
+
+static int legacy_readline(request_t *r, unsigned int *off, char *line, int maxlen) {
+	int n, c;
+
+	for (n = 0; n < maxlen - 1 && (c = legacy_getc(r, off)) != -1; ) {
+		line[n++] = c;
+		if (c == '\n')
+			break;
+	}
+	line[n] = '\0';
+	return n;
+}
+
+static unsigned int legacy_rewrite(request_t *r, char *str) {
+	char line[MAXLINE], method[MAXLINE], url[MAXLINE], version[MAXLINE];
+	char host_port[MAXLINE], resource[MAXLINE];
+	unsigned int off = 0;
+
+	legacy_readline(r, &off, line, sizeof(line));
+	strcpy(resource, "/");
+	host_port[0] = '\0';
+	sscanf(line, "%s %s %s", method, url, version);
+	if (strstr(url, "://"))
+		sscanf(url, "%*[^:]://%[^/]%s", host_port, resource);
+	strcpy(str, method);
+	strcat(str, " ");
+	strcat(str, resource);
+	strcat(str, " HTTP/1.1\r\n");
+	strcat(str, "Host: ");
+	strcat(str, host_port);
+	strcat(str, "\r\n");
+	strcat(str, legacy_fixed);
+
+	while (legacy_readline(r, &off, line, sizeof(line)) > 0 && strcmp(line, "\r\n")) {
+		if (strstr(line, "User-Agent:") || strstr(line, "Accept:") ||
+				strstr(line, "Accept-Encoding:") || strstr(line, "Connection:") ||
+				strstr(line, "Proxy-Connection:") || strstr(line, "Cookie:") || strstr(line, "Host:"))
+			continue;
+		strcat(str, line);
+	}
+	strcat(str, "\r\n");
+	return strlen(str);
+}
+
+static void report(const char *name, double secs, int rounds, unsigned long check) {
+	double n = (double)nreqs * rounds;
+
+	printf("%-8s %9.0f req/s %8.1f MB/s %7.0f ns/req  (check %lu)\n", name,
+		n / secs, corpus_bytes * (double)rounds / secs / 1e6, secs * 1e9 / n, check);
+}
+
+int main(int argc, char **argv) {
+	char host[MAXLINE], port[MAXLINE], resource[MAXLINE], str[MAXBUF];
+	HttpRequest req;
+	HttpOut out;
+	unsigned long check;
+	double start;
+	int rounds = 2000, c, i, r, j;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc || rounds <= 0)
+		usage();
+	for (i = optind; i < argc; i++)
+		load_corpus(argv[i]);
+	printf("%d requests, %lu bytes, %d rounds\n", nreqs, corpus_bytes, rounds);
+
+	check = 0;
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < nreqs; i++)
+			check += http_parse_request(reqs[i].data, reqs[i].len, &req);
+	report("parse", now() - start, rounds, check);
+
+	check = 0;
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < nreqs; i++) {
+			http_parse_request(reqs[i].data, reqs[i].len, &req);
+			http_rewrite_request(&req, &out, host, port, resource, 1);
+			for (j = 0; j < out.iovcnt; j++)
+				check += out.iov[j].iov_len;
+		}
+	report("rewrite", now() - start, rounds, check);
+
+	check = 0;
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < nreqs; i++)
+			check += legacy_rewrite(&reqs[i], str);
+	report("legacy", now() - start, rounds, check);
+
+	return 0;
+}
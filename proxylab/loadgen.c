@@ -0,0 +1,313 @@
+/*
+ * loadgen.c - HTTP load generator for the proxy, against benchorigin.
+ *
+ * Each of -c threads keeps one keep-alive connection to the proxy and asks
+ * it for Zipf-distributed keys of benchorigin on localhost. Object sizes
+ * are log-normal around -b bytes (fixed per key, -w 0 makes them all -b)
+ * and -u percent of the keys are served no-store. The same -S seed gives
+ * the same request sequence, so runs against different proxy modes and
+ * cache policies see the same workload.
+ *
+ * Closed loop (default): every thread sends its next request as soon as
+ * the previous response is in. Open loop (-r): requests are scheduled at
+ * a fixed total rate and latency counts from the scheduled time, so a
+ * stalled proxy is charged for the requests that queue up behind it.
+ *
+ * The report gives requests per second, latency percentiles and the
+ * proxy's own hit and byte hit ratios over the run, read from /__stats
+ * before and after.
+ *
+ * usage: loadgen [-c conns] [-t secs | -n requests] [-r rate] [-k keys] [-z skew]
+ *                [-b bytes] [-w spread] [-u nostore%] [-S seed] proxy-port origin-port
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <time.h>
+
+#include "csapp.h"
+
+#define STATS_REQUEST "GET /__stats HTTP/1.0\r\n\r\n"
+
+enum { PS_REQUESTS, PS_HITS, PS_DISK_HITS, PS_SHARED_HITS, PS_REVALIDATED, PS_BYTES_OUT, PS_BYTES_HIT, PS_FIELDS };
+static const char *proxy_fields[PS_FIELDS] = {
+	"requests", "hits", "disk_hits", "shared_hits", "revalidated", "bytes_out", "bytes_hit"
+};
+
+static int proxy_port, origin_port;
+static int nkeys = 1000;
+static unsigned int median = 4096;
+static double spread = 1.0;
+static int nostore_pct;
+static double *cdf;				/* cumulative Zipf probabilities of the keys */
+static double interval;			/* open loop: seconds between one thread's requests */
+static double deadline;			/* time at which threads stop, with -t */
+static long total;				/* requests to send, with -n */
+static long remaining;			/* of those, not yet started */
+
+typedef struct {
+	unsigned int seed;
+	double start;				/* first scheduled send, open loop */
+	unsigned long long *lat;	/* nanoseconds per completed request */
+	unsigned long nlat, alloc;
+	unsigned long errors;
+	unsigned long long bytes;
+} client_t;
+
+static void usage(void) {
+	fprintf(stderr, "usage: loadgen [-c conns] [-t secs | -n requests] [-r rate] [-k keys] [-z skew]\n");
+	fprintf(stderr, "               [-b bytes] [-w spread] [-u nostore%%] [-S seed] proxy-port origin-port\n");
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double uniform(unsigned int *seed) {
+	return ((double)rand_r(seed) + 1) / ((double)RAND_MAX + 2);
+}
+
+static int pick_key(unsigned int *seed) {
+	double u = uniform(seed);
+	int lo = 0, hi = nkeys - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* object_size - log-normal around median, the same for a key in every run */
+static unsigned int object_size(int key) {
+	unsigned int seed = key * 2654435761u + 1;
+	double n = sqrt(-2 * log(uniform(&seed))) * cos(2 * M_PI * uniform(&seed));
+
+	return (unsigned int)(median * exp(spread * n));
+}
+
+/* fetch - one request on *fd, connecting first if needed; returns body bytes or -1 */
+static long long fetch(int *fd, rio_t *rio, char *request, char *body) {
+	char line[MAXLINE];
+	long long length = -1, got = 0;
+	int close_after = 0, status = 0, fresh;
+	ssize_t n;
+
+	fresh = *fd < 0;
+	if (fresh) {
+		if ((*fd = open_clientfd("127.0.0.1", proxy_port)) < 0)
+			return -1;
+		Rio_readinitb(rio, *fd);
+	}
+	if (rio_writen(*fd, request, strlen(request)) == -1 || rio_readlineb(rio, line, sizeof(line)) <= 0) {
+		close(*fd);
+		*fd = -1;
+		/* a kept-alive connection the proxy closed meanwhile gets one retry */
+		return fresh ? -1 : fetch(fd, rio, request, body);
+	}
+	if (sscanf(line, "HTTP/1.%*d %d", &status) != 1 || !strncmp(line, "HTTP/1.0", 8))
+		close_after = 1;
+	while ((n = rio_readlineb(rio, line, sizeof(line))) > 0 && strcmp(line, "\r\n")) {
+		if (!strncasecmp(line, "Content-Length:", 15))
+			length = strtoll(line + 15, NULL, 10);
+		else if (!strncasecmp(line, "Connection:", 11) && strcasestr(line + 11, "close"))
+			close_after = 1;
+	}
+	if (n <= 0)
+		status = 0;
+	/* without a length the body runs to EOF */
+	while (status && (length < 0 || got < length)) {
+		n = length < 0 || length - got > MAXBUF ? MAXBUF : length - got;
+		if ((n = rio_readnb(rio, body, n)) <= 0)
+			break;
+		got += n;
+	}
+	if (length < 0 || got < length)
+		close_after = 1;
+	if (close_after) {
+		close(*fd);
+		*fd = -1;
+	}
+	return status == 200 && (length < 0 || got == length) ? got : -1;
+}
+
+static int next_request(void) {
+	if (total)
+		return __atomic_sub_fetch(&remaining, 1, __ATOMIC_RELAXED) >= 0;
+	return now() < deadline;
+}
+
+static void *client_thread(void *vargp) {
+	client_t *cl = vargp;
+	char request[MAXLINE], body[MAXBUF];
+	double scheduled = cl->start, sent;
+	long long got;
+	int fd = -1, key;
+	struct timespec ts;
+	rio_t rio;
+
+	while (next_request()) {
+		key = pick_key(&cl->seed);
+		sprintf(request, "GET http://127.0.0.1:%d/%s%u/%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+			origin_port, (unsigned int)key * 2654435761u % 100 < nostore_pct ? "nostore/" : "",
+			object_size(key), key, origin_port);
+		if (interval) {
+			/* open loop: wait for the slot, or send at once if already late */
+			if ((sent = scheduled - now()) > 0) {
+				ts.tv_sec = sent;
+				ts.tv_nsec = (sent - ts.tv_sec) * 1e9;
+				nanosleep(&ts, NULL);
+			}
+			sent = scheduled;
+			scheduled += interval;
+		}
+		else
+			sent = now();
+		if ((got = fetch(&fd, &rio, request, body)) < 0) {
+			cl->errors++;
+			continue;
+		}
+		cl->bytes += got;
+		if (cl->nlat == cl->alloc) {
+			cl->alloc = cl->alloc ? 2 * cl->alloc : 4096;
+			cl->lat = Realloc(cl->lat, cl->alloc * sizeof(unsigned long long));
+		}
+		cl->lat[cl->nlat++] = (now() - sent) * 1e9;
+	}
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+/* proxy_stats - the proxy's counters from /__stats; returns -1 if unavailable */
+static int proxy_stats(unsigned long long *v) {
+	char page[2 * MAXBUF], key[64], *p;
+	ssize_t len = 0, n;
+	int fd, i;
+
+	if ((fd = open_clientfd("127.0.0.1", proxy_port)) < 0)
+		return -1;
+	if (rio_writen(fd, STATS_REQUEST, strlen(STATS_REQUEST)) == -1) {
+		close(fd);
+		return -1;
+	}
+	while (len < sizeof(page) - 1 && (n = read(fd, page + len, sizeof(page) - 1 - len)) > 0)
+		len += n;
+	close(fd);
+	page[len] = '\0';
+	for (i = 0; i < PS_FIELDS; i++) {
+		sprintf(key, "\n%s: ", proxy_fields[i]);
+		if (!(p = strstr(page, key)))
+			return -1;
+		v[i] = strtoull(p + strlen(key), NULL, 10);
+	}
+	return 0;
+}
+
+static int cmp_lat(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+	int nconns = 16, c, i;
+	double secs = 10, rate = 0, skew = 0.99, sum = 0, start, elapsed;
+	unsigned int seed = 1;
+	unsigned long long before[PS_FIELDS], after[PS_FIELDS], *lat, bytes = 0;
+	unsigned long nlat = 0, errors = 0;
+	int have_stats;
+	const double pcts[] = {0.5, 0.9, 0.99, 0.999};
+	pthread_t *tids;
+	client_t *cls;
+
+	while ((c = getopt(argc, argv, "c:t:n:r:k:z:b:w:u:S:")) != -1) {
+		switch (c) {
+		case 'c': nconns = atoi(optarg); break;
+		case 't': secs = atof(optarg); break;
+		case 'n': remaining = total = atol(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'k': nkeys = atoi(optarg); break;
+		case 'z': skew = atof(optarg); break;
+		case 'b': median = atoi(optarg); break;
+		case 'w': spread = atof(optarg); break;
+		case 'u': nostore_pct = atoi(optarg); break;
+		case 'S': seed = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 2 || nconns <= 0 || secs <= 0 || total < 0 || rate < 0 || nkeys <= 0)
+		usage();
+	proxy_port = atoi(argv[optind]);
+	origin_port = atoi(argv[optind + 1]);
+
+	cdf = Malloc(nkeys * sizeof(double));
+	for (i = 0; i < nkeys; i++)
+		cdf[i] = sum += 1.0 / pow(i + 1, skew);
+	for (i = 0; i < nkeys; i++)
+		cdf[i] /= sum;
+	if (rate)
+		interval = nconns / rate;
+
+	Signal(SIGPIPE, SIG_IGN);
+	have_stats = proxy_stats(before) == 0;
+	tids = Malloc(nconns * sizeof(pthread_t));
+	cls = Calloc(nconns, sizeof(client_t));
+	start = now();
+	deadline = start + secs;
+	for (i = 0; i < nconns; i++) {
+		cls[i].seed = seed * 7919 + i;
+		cls[i].start = start + i * interval / nconns;	/* spread the threads' slots */
+		Pthread_create(&tids[i], NULL, client_thread, &cls[i]);
+	}
+	for (i = 0; i < nconns; i++) {
+		Pthread_join(tids[i], NULL);
+		nlat += cls[i].nlat;
+		errors += cls[i].errors;
+		bytes += cls[i].bytes;
+	}
+	elapsed = now() - start;
+	have_stats = have_stats && proxy_stats(after) == 0;
+
+	lat = Malloc((nlat ? nlat : 1) * sizeof(unsigned long long));
+	for (nlat = 0, i = 0; i < nconns; i++) {
+		memcpy(lat + nlat, cls[i].lat, cls[i].nlat * sizeof(unsigned long long));
+		nlat += cls[i].nlat;
+		free(cls[i].lat);
+	}
+	qsort(lat, nlat, sizeof(unsigned long long), cmp_lat);
+
+	printf("proxy :%d  origin :%d  %d connections  %s  keys %d  skew %.2f  size %u (spread %.1f)  nostore %d%%\n",
+		proxy_port, origin_port, nconns, rate ? "open loop" : "closed loop", nkeys, skew, median, spread, nostore_pct);
+	if (rate)
+		printf("offered %.0f req/s\n", rate);
+	printf("requests %lu  errors %lu  %.1f s  %.0f req/s  %.1f MB/s\n",
+		nlat, errors, elapsed, nlat / elapsed, bytes / elapsed / 1e6);
+	if (nlat) {
+		printf("latency ms");
+		for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+			printf("  p%g %.3f", pcts[i] * 100, lat[(unsigned long)(pcts[i] * nlat)] / 1e6);
+		printf("  max %.3f\n", lat[nlat - 1] / 1e6);
+	}
+	if (have_stats && after[PS_REQUESTS] > before[PS_REQUESTS])
+		printf("proxy hit ratio %.4f  byte hit ratio %.4f\n",
+			(double)(after[PS_HITS] + after[PS_DISK_HITS] + after[PS_SHARED_HITS] + after[PS_REVALIDATED] -
+				before[PS_HITS] - before[PS_DISK_HITS] - before[PS_SHARED_HITS] - before[PS_REVALIDATED]) /
+				(after[PS_REQUESTS] - before[PS_REQUESTS]),
+			after[PS_BYTES_OUT] > before[PS_BYTES_OUT] ? (double)(after[PS_BYTES_HIT] - before[PS_BYTES_HIT]) /
+				(after[PS_BYTES_OUT] - before[PS_BYTES_OUT]) : 0.0);
+	else
+		printf("proxy hit ratio unavailable (no /__stats)\n");
+
+	free(lat);
+	free(cls);
+	free(tids);
+	free(cdf);
+	return 0;
+}
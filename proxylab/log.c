@@ -0,0 +1,158 @@
+/*
+ * log.c - asynchronous logfmt logging. A thread formats its record into
+ * its own ring (see LogRing) and carries on; one writer thread gathers
+ * whatever all rings hold into a batch and hands it to the kernel in a
+ * single write, so the request path never waits on the log file. Until
+ * log_init runs, records go straight to stderr.
+ */
+#include <stdarg.h>
+
+#include "log.h"
+
+int log_level = LOG_WARN;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+static int log_fd = -1;		/* -1 until the writer thread is running */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogRing *rings;
+static __thread LogRing *ring;
+
+/* stats */
+static unsigned long batches;
+static unsigned long long written;
+
+static LogRing *my_ring(void);
+static int format(char *buf, unsigned int size, int level, const char *fmt, va_list ap);
+static unsigned int drain(char *batch);
+static void *writer(void *vargp);
+
+static LogRing *my_ring(void) {
+	if (!ring) {
+		ring = Calloc(1, sizeof(LogRing));
+		pthread_mutex_lock(&rings_lock);
+		ring->next = rings;
+		__atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&rings_lock);
+	}
+	return ring;
+}
+
+int log_find_level(char *name) {
+	int i;
+
+	for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++)
+		if (!strcmp(name, level_names[i]))
+			return i;
+	return -1;
+}
+
+/* format - "ts=<unix time> level=<name> <caller's fields>\n", cut to size */
+static int format(char *buf, unsigned int size, int level, const char *fmt, va_list ap) {
+	struct timespec ts;
+	unsigned int len;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	/* size - 1 keeps room for the newline in place of the terminator */
+	len = snprintf(buf, size - 1, "ts=%ld.%06ld level=%s ", (long)ts.tv_sec, ts.tv_nsec / 1000,
+		level_names[level]);
+	len += vsnprintf(buf + len, size - 1 - len, fmt, ap);
+	if (len > size - 2)
+		len = size - 2;
+	if (buf[len - 1] == '\n')
+		len--;
+	buf[len++] = '\n';
+	return len;
+}
+
+/*
+ * log_msg - queue one record. Never blocks: if this thread's ring is full
+ * because the writer has fallen behind, the record is dropped and counted.
+ */
+void log_msg(int level, const char *fmt, ...) {
+	char line[LOG_RECORD];
+	unsigned long head;
+	LogRing *r;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	if (__atomic_load_n(&log_fd, __ATOMIC_ACQUIRE) < 0) {
+		len = format(line, sizeof(line), level, fmt, ap);
+		va_end(ap);
+		rio_writen(STDERR_FILENO, line, len);
+		return;
+	}
+	r = my_ring();
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING) {
+		va_end(ap);
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	r->lens[head % LOG_RING] = format(r->records[head % LOG_RING], LOG_RECORD, level, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* drain - move every queued record that fits into batch; returns its length */
+static unsigned int drain(char *batch) {
+	unsigned long head, tail;
+	unsigned int len = 0, n;
+	LogRing *r;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail = r->tail; tail != head; tail++) {
+			n = r->lens[tail % LOG_RING];
+			if (len + n > LOG_BATCH)
+				break;
+			memcpy(batch + len, r->records[tail % LOG_RING], n);
+			len += n;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	return len;
+}
+
+/* writer - the one thread that touches the log file */
+static void *writer(void *vargp) {
+	char *batch = Malloc(LOG_BATCH);
+	struct timespec idle = {0, LOG_FLUSH_MS * 1000000L};
+	unsigned int len;
+
+	Pthread_detach(pthread_self());
+	while (1) {
+		if (!(len = drain(batch))) {
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		rio_writen(log_fd, batch, len);
+		__atomic_add_fetch(&batches, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&written, len, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* log_init - log to path, or stderr if NULL, from now on; returns -1 if it can't be opened */
+int log_init(char *path, int level) {
+	pthread_t tid;
+	int fd = STDERR_FILENO;
+
+	if (path && (fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+		return -1;
+	log_level = level;
+	__atomic_store_n(&log_fd, fd, __ATOMIC_RELEASE);
+	Pthread_create(&tid, NULL, writer, NULL);
+	return 0;
+}
+
+int log_stats(char *buf, unsigned int size) {
+	unsigned long dropped = 0;
+	LogRing *r;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+		dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	return snprintf(buf, size, "log_batches: %lu\nlog_bytes: %llu\nlog_dropped: %lu\n",
+		__atomic_load_n(&batches, __ATOMIC_RELAXED), __atomic_load_n(&written, __ATOMIC_RELAXED), dropped);
+}
@@ -0,0 +1,37 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "csapp.h"
+
+#define LOG_RING 256			/* records buffered per thread */
+#define LOG_RECORD 256			/* bytes per record; longer lines are cut */
+#define LOG_BATCH (64 * 1024)	/* bytes the writer gathers per write */
+#define LOG_FLUSH_MS 10			/* writer sleep when every ring is empty */
+
+enum log_level { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+/*
+ * One thread's records. The owner is the only producer and the writer
+ * thread the only consumer, so head and tail are the whole protocol: a
+ * full ring drops the record instead of waiting.
+ */
+typedef struct LogRing {
+	char records[LOG_RING][LOG_RECORD];
+	unsigned short lens[LOG_RING];
+	unsigned long head;			/* next record to fill; written by the owner */
+	unsigned long tail;			/* next record to write out; written by the writer */
+	unsigned long dropped;
+	struct LogRing *next;
+} LogRing;
+
+extern int log_level;
+
+int log_init(char *path, int level);
+int log_find_level(char *name);
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int log_stats(char *buf, unsigned int size);
+
+/* the level test is inlined so a disabled record costs one comparison */
+#define LOG(level, ...) do { if ((level) <= log_level) log_msg((level), __VA_ARGS__); } while (0)
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * policy.c - cache eviction policies and the TinyLFU frequency sketch.
+ *
+ * clock  CLOCK (second chance): a hit sets a bit, the hand clears bits
+ *        until it finds an entry that was not hit since the last sweep.
+ * gdsf   Greedy-Dual-Size-Frequency: an entry is worth
+ *        H = L + frequency / size, so small, often hit objects stay and
+ *        large ones leave first. L is the shard's inflation value, raised
+ *        to the H of every victim, which ages entries that stop being hit.
+ *        Hits only run under a read lock, so instead of keeping a heap the
+ *        victim is the lowest H among GDSF_SAMPLES entries at the hand.
+ *
+ * With admission on (TinyLFU), cache.c only lets a new object evict an
+ * entry whose sketched frequency is lower than its own.
+ */
+#include "cache.h"
+
+static void clock_hit(CacheShard *shard, CachedItem *node);
+static void clock_insert(CacheShard *shard, CachedItem *node);
+static CachedItem *clock_victim(CacheShard *shard);
+static void gdsf_hit(CacheShard *shard, CachedItem *node);
+static void gdsf_insert(CacheShard *shard, CachedItem *node);
+static CachedItem *gdsf_victim(CacheShard *shard);
+static unsigned long long gdsf_priority(CachedItem *node);
+static unsigned int sketch_slot(unsigned long long hash, int row);
+
+const CachePolicy clock_policy = {"clock", clock_hit, clock_insert, clock_victim};
+const CachePolicy gdsf_policy = {"gdsf", gdsf_hit, gdsf_insert, gdsf_victim};
+
+static const CachePolicy *policies[] = {&clock_policy, &gdsf_policy, NULL};
+
+const CachePolicy *find_policy(const char *name) {
+	int i;
+
+	for (i = 0; policies[i]; i++)
+		if (!strcmp(policies[i]->name, name))
+			return policies[i];
+	return NULL;
+}
+
+static void clock_hit(CacheShard *shard, CachedItem *node) {
+	if (!__atomic_load_n(&node->referenced, __ATOMIC_RELAXED))
+		__atomic_store_n(&node->referenced, 1, __ATOMIC_RELAXED);
+}
+
+static void clock_insert(CacheShard *shard, CachedItem *node) {
+	node->referenced = 0;
+}
+
+/* clock_victim - referenced entries get their bit cleared and a second chance */
+static CachedItem *clock_victim(CacheShard *shard) {
+	while (shard->hand->referenced) {
+		shard->hand->referenced = 0;
+		shard->hand = shard->hand->next;
+	}
+	return shard->hand;
+}
+
+/* frequency per byte in 1/2^24 units, on top of the inflation at the last hit */
+static unsigned long long gdsf_priority(CachedItem *node) {
+	unsigned int length = node->length ? node->length : 1;
+
+	return __atomic_load_n(&node->base, __ATOMIC_RELAXED) +
+		((unsigned long long)__atomic_load_n(&node->freq, __ATOMIC_RELAXED) << 24) / length;
+}
+
+static void gdsf_hit(CacheShard *shard, CachedItem *node) {
+	__atomic_add_fetch(&node->freq, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&node->base, shard->inflation, __ATOMIC_RELAXED);
+}
+
+static void gdsf_insert(CacheShard *shard, CachedItem *node) {
+	node->freq = 1;
+	node->base = shard->inflation;
+}
+
+/* gdsf_victim - lowest H among the sampled entries; the hand moves past them */
+static CachedItem *gdsf_victim(CacheShard *shard) {
+	CachedItem *node = shard->hand, *victim = NULL;
+	unsigned long long h, best = 0;
+	int i;
+
+	for (i = 0; i < GDSF_SAMPLES; i++) {
+		h = gdsf_priority(node);
+		if (!victim || h < best) {
+			victim = node;
+			best = h;
+		}
+		if ((node = node->next) == shard->hand)
+			break;
+	}
+	shard->hand = node;
+	if (best > shard->inflation)
+		shard->inflation = best;
+	return victim;
+}
+
+/* sketch_slot - row's counter for hash, from two independent halves of it */
+static unsigned int sketch_slot(unsigned long long hash, int row) {
+	unsigned int h1 = hash, h2 = (hash >> 32) | 1;
+
+	return (h1 + row * h2) & (SKETCH_WIDTH - 1);
+}
+
+void sketch_add(Sketch *sketch, unsigned long long hash) {
+	unsigned char *c;
+	int row;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		c = &sketch->counters[row][sketch_slot(hash, row)];
+		if (__atomic_load_n(c, __ATOMIC_RELAXED) < SKETCH_MAX)
+			__atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&sketch->additions, 1, __ATOMIC_RELAXED);
+}
+
+unsigned int sketch_estimate(Sketch *sketch, unsigned long long hash) {
+	unsigned int min = SKETCH_MAX, c;
+	int row;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		c = __atomic_load_n(&sketch->counters[row][sketch_slot(hash, row)], __ATOMIC_RELAXED);
+		if (c < min)
+			min = c;
+	}
+	return min;
+}
+
+/* sketch_age - halve every counter once SKETCH_SAMPLE * SKETCH_WIDTH accesses were counted */
+void sketch_age(Sketch *sketch) {
+	unsigned char *c = &sketch->counters[0][0];
+	int i;
+
+	if (__atomic_load_n(&sketch->additions, __ATOMIC_RELAXED) < SKETCH_SAMPLE * SKETCH_WIDTH)
+		return;
+	for (i = 0; i < SKETCH_DEPTH * SKETCH_WIDTH; i++)
+		__atomic_store_n(&c[i], __atomic_load_n(&c[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&sketch->additions, 0, __ATOMIC_RELAXED);
+}
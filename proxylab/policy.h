@@ -0,0 +1,45 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+struct CacheShard;
+struct CachedItem;
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024	/* counters per row and shard, a power of 2 */
+#define SKETCH_SAMPLE 10	/* halve the counters after SAMPLE * WIDTH accesses */
+#define SKETCH_MAX 15
+#define GDSF_SAMPLES 8		/* entries compared per GDSF eviction */
+
+/*
+ * Count-min sketch of recent access frequency, one per shard. Counters are
+ * bumped with atomics under the shard's read lock; halving them to age
+ * old counts happens under the write lock and may race with a bump,
+ * which only costs that bump.
+ */
+typedef struct Sketch {
+	unsigned char counters[SKETCH_DEPTH][SKETCH_WIDTH];
+	unsigned int additions;
+} Sketch;
+
+/*
+ * An eviction policy. hit runs under the shard's read lock, so it may only
+ * touch the entry with atomics; insert and victim run under the write
+ * lock. victim returns the next entry to evict without unlinking it.
+ */
+typedef struct CachePolicy {
+	const char *name;
+	void (*hit)(struct CacheShard *shard, struct CachedItem *node);
+	void (*insert)(struct CacheShard *shard, struct CachedItem *node);
+	struct CachedItem *(*victim)(struct CacheShard *shard);
+} CachePolicy;
+
+extern const CachePolicy clock_policy;
+extern const CachePolicy gdsf_policy;
+
+const CachePolicy *find_policy(const char *name);
+
+void sketch_add(Sketch *sketch, unsigned long long hash);
+unsigned int sketch_estimate(Sketch *sketch, unsigned long long hash);
+void sketch_age(Sketch *sketch);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * procs.c - multi-process mode (--processes=<n>).
+ *
+ * The parent forks n workers and then only restarts any that die. Each
+ * worker is pinned to one core and opens its own SO_REUSEPORT listener on
+ * the proxy port, so the kernel spreads new connections over the workers
+ * and no accept loop or listen queue is shared. Workers then run the
+ * normal threads or events mode with their own caches (see shmcache.c
+ * for the tier they can share). Their connection and request counts live
+ * in shared memory, so any worker can report the balance on /__stats.
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/prctl.h>
+
+#include "procs.h"
+#include "log.h"
+
+int proc_index = -1;
+
+static ProcSlot *slots;
+static int nprocs;
+
+static int spawn(int i);
+
+/* spawn - fork worker i; returns 0 in the worker, 1 in the parent */
+static int spawn(int i) {
+	pid_t parent = getpid(), pid;
+	cpu_set_t set;
+
+	if ((pid = fork()) < 0) {
+		fprintf(stderr, "fork error: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (pid) {
+		slots[i].pid = pid;
+		return 1;
+	}
+	/* workers go down with the parent */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != parent)
+		exit(0);
+	proc_index = i;
+	slots[i].pid = getpid();
+	__atomic_add_fetch(&slots[i].starts, 1, __ATOMIC_RELAXED);
+	CPU_ZERO(&set);
+	CPU_SET(slots[i].cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+	return 0;
+}
+
+/*
+ * procs_start - fork n workers and return the caller's worker index in
+ * each of them. The parent never returns: it restarts workers killed by a
+ * signal, and exits (taking the rest down) when one exits by itself,
+ * which only happens when a worker fails to start.
+ */
+int procs_start(int n) {
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN), status, i;
+	pid_t pid;
+
+	if (ncpus <= 0)
+		ncpus = 1;
+	nprocs = n;
+	slots = mmap(NULL, n * sizeof(ProcSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED) {
+		fprintf(stderr, "mmap error: %s\n", strerror(errno));
+		exit(1);
+	}
+	memset(slots, 0, n * sizeof(ProcSlot));
+	for (i = 0; i < n; i++) {
+		slots[i].cpu = i % ncpus;
+		if (!spawn(i))
+			return i;
+	}
+
+	while (1) {
+		if ((pid = wait(&status)) < 0) {
+			if (errno == EINTR)
+				continue;
+			exit(1);
+		}
+		for (i = 0; i < n && slots[i].pid != pid; i++)
+			;
+		if (i == n)
+			continue;
+		if (WIFEXITED(status))
+			exit(WEXITSTATUS(status) ? WEXITSTATUS(status) : 1);
+		LOG(LOG_ERROR, "msg=\"worker died\" worker=%d pid=%d signal=%d", i, (int)pid, WTERMSIG(status));
+		sleep(1);
+		if (!spawn(i))
+			return i;
+	}
+}
+
+/* procs_listenfd - open_listenfd, but sharing the port with the other workers */
+int procs_listenfd(int port) {
+	struct sockaddr_in serveraddr;
+	int listenfd, optval = 1;
+
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+			setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+		close(listenfd);
+		return -1;
+	}
+	memset(&serveraddr, 0, sizeof(serveraddr));
+	serveraddr.sin_family = AF_INET;
+	serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	serveraddr.sin_port = htons((unsigned short)port);
+	if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+void procs_add(int connections, int requests) {
+	if (proc_index < 0)
+		return;
+	if (connections)
+		__atomic_add_fetch(&slots[proc_index].connections, connections, __ATOMIC_RELAXED);
+	if (requests)
+		__atomic_add_fetch(&slots[proc_index].requests, requests, __ATOMIC_RELAXED);
+}
+
+/*
+ * procs_report - one line (or JSON object) per worker and the balance:
+ * the busiest worker's requests over the mean, 1.00 when even. Nothing
+ * without --processes. JSON output continues an object, ", " first.
+ */
+int procs_report(char *buf, unsigned int size, int json) {
+	unsigned long connections, requests, total = 0, most = 0;
+	int len = 0, i;
+
+	if (proc_index < 0)
+		return 0;
+	if (json)
+		len += snprintf(buf + len, size - len, ", \"processes\": [");
+	else
+		len += snprintf(buf + len, size - len, "processes: %d\n", nprocs);
+	for (i = 0; i < nprocs && (unsigned int)len < size; i++) {
+		connections = __atomic_load_n(&slots[i].connections, __ATOMIC_RELAXED);
+		requests = __atomic_load_n(&slots[i].requests, __ATOMIC_RELAXED);
+		total += requests;
+		if (requests > most)
+			most = requests;
+		if (json)
+			len += snprintf(buf + len, size - len,
+				"%s{\"pid\": %d, \"cpu\": %d, \"starts\": %lu, \"connections\": %lu, \"requests\": %lu}",
+				i ? ", " : "", (int)slots[i].pid, slots[i].cpu, slots[i].starts, connections, requests);
+		else
+			len += snprintf(buf + len, size - len,
+				"process_%d: pid %d cpu %d starts %lu connections %lu requests %lu\n",
+				i, (int)slots[i].pid, slots[i].cpu, slots[i].starts, connections, requests);
+	}
+	if ((unsigned int)len < size)
+		len += snprintf(buf + len, size - len, json ? "], \"process_balance\": %.2f" : "process_balance: %.2f\n",
+			total ? (double)most * nprocs / total : 1.0);
+	return (unsigned int)len < size ? len : (int)size - 1;
+}
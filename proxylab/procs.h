@@ -0,0 +1,24 @@
+#ifndef __PROCS_H__
+#define __PROCS_H__
+
+#include "csapp.h"
+
+#define MAX_PROCS 64
+
+/* one worker process's counters, in memory shared with the others */
+typedef struct ProcSlot {
+	pid_t pid;
+	int cpu;					/* core it is pinned to */
+	unsigned long starts;		/* 1 + times it was restarted */
+	unsigned long connections;
+	unsigned long requests;
+} ProcSlot;
+
+extern int proc_index;	/* this worker's slot, -1 without --processes */
+
+int procs_start(int n);
+int procs_listenfd(int port);
+void procs_add(int connections, int requests);
+int procs_report(char *buf, unsigned int size, int json);
+
+#endif
@@ -1,36 +1,72 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
 
 #include "cache.h"
 #include "csapp.h"
-
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include "proxy.h"
+#include "event.h"
+#include "sbuf.h"
+#include "connpool.h"
+#include "collapse.h"
+#include "splice.h"
+#include "stats.h"
+#include "log.h"
+#include "procs.h"
+#include "bufpool.h"
 
 #define MIN_PORT_NUMBER 4500
 #define MAX_PORT_NUMBER 65000
 
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_str = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding = "Accept-Encoding: gzip, deflate\r\n";
+#define MODE_THREADS 0
+#define MODE_EVENTS 1
+
+#define DEFAULT_WORKERS 16
+#define QUEUE_PER_WORKER 4
+#define POOL_STATS_PATH "/__pool"
+#define DEFAULT_CLIENT_IDLE 15	/* seconds a keep-alive client may stay silent */
 
-static const char *connection = "Connection: close\r\n";
-static const char *proxy_connection = "Proxy-Connection: close\r\n";
-static const char *init_version = "HTTP/1.0\r\n";
-static const char *fail_str = "HTTP/1.0 400 Bad Request\r\n";
+const char *fail_str = "HTTP/1.0 400 Bad Request\r\n";
+static const char *busy_str = "HTTP/1.0 503 Service Unavailable\r\n\r\n";
 
 CacheList *list;
+Sbuf sbuf;	/* accepted fds waiting for a worker */
+ConnPool pool;	/* idle keep-alive connections to origin servers */
+DnsCache dns;	/* resolved origin addresses */
+CollapseTable collapse;	/* misses currently being fetched */
+DiskCache disk;	/* objects evicted from memory, with --disk-cache */
+ShmCache *shared_cache;	/* shared by the workers, with --process-cache=shared */
+int client_idle = DEFAULT_CLIENT_IDLE;	/* 0 closes clients after one request */
+
+/* revalidation of stale hits */
+static unsigned long revalidations;
+static unsigned long not_modified;
+static unsigned long long bytes_saved;	/* stored bytes a 304 spared the origin from sending */
 
 /* function prototypes */
 void usage();
-void handle_client(int *arg);
-int read_request(char *str, int client_fd, char *host, char *port, char *cache_index, char *resource);
-int forward_to_server(char *host, char *port, int *server_fd, char *request_str);
-int read_and_forward_response(int server_fd, int client_fd, char *cache_index, char *content);
-int forward_content_to_client(int client_fd, char *content, unsigned int len);
-
-int append(char *content, char *str, unsigned int add_size, unsigned int *prev_size);
-int parse_request(char *str, char *method, char *protocol, char *host_port, char *resource, char *version);
-void get_host_and_port(char *host_port, char *host, char *port);
+void *worker(void *vargp);
+void handle_client(int client_fd);
+int serve_request(rio_t *rio_client, int client_fd);
+int serve_pool_stats(int client_fd, int keep_alive);
+int serve_stats(int client_fd, int keep_alive, int json);
+int splice_body(rio_t *rio_server, int client_fd, unsigned long long n);
+int read_request(rio_t *rio_client, HttpOut *out, char *host, char *port, char *cache_index, char *resource, int *keep_alive, int *credentials, int *minor);
+int forward_to_server(char *host, char *port, int fresh, int *server_fd, HttpOut *out, int *reused);
+int read_and_forward_response(int server_fd, int client_fd, int client_minor, int credentials, char *cache_index, int *reusable, int *keep_alive, Pending *pending, CacheObject *stale);
+int forward_response(int server_fd, int client_fd, int client_minor, int credentials, char *cache_index, char *tmp_str, BufChain *copy, int *reusable, int *keep_alive, Pending *pending, CacheObject *stale);
+int relay(int client_fd, char *str, unsigned int len, BufChain *copy, int *valid_size, Pending *pending);
+int can_splice(int valid_size, Pending *pending, unsigned long long more);
+int forward_cached_to_client(int client_fd, CacheObject *object, int *keep_alive);
+int forward_disk_to_client(int client_fd, DiskRef *ref, int *keep_alive);
+int forward_stored_to_client(int client_fd, char *data, unsigned int length, DiskRef *ref, int *keep_alive);
+int forward_collapsed_to_client(int client_fd, int client_minor, Pending *pending, Reader *reader, int *keep_alive);
+int response_head(char *data, unsigned int len, unsigned int *head);
+int hop_by_hop(char *line);
+
+int append(BufChain *copy, char *str, unsigned int len);
+int set_length(BufChain *copy, unsigned int head);
 void close_fd(int *client_fd, int *server_fd);
 
 int main(int argc, char **argv)
@@ -39,162 +75,599 @@ int main(int argc, char **argv)
 	struct sockaddr_in clientaddr;
 	int clientlen = sizeof(clientaddr);
 	int listenfd;
+	int mode = MODE_THREADS, loops = 0;
+	int workers = DEFAULT_WORKERS, queue = 0, overflow = SBUF_BLOCK;
+	int shards = 0, admission = 1;
+	const CachePolicy *policy = &gdsf_policy;
+	int pool_per_host = DEFAULT_POOL_PER_HOST, pool_idle = DEFAULT_POOL_IDLE, pool_max_idle = DEFAULT_POOL_MAX_IDLE;
+	int dns_ttl = DEFAULT_DNS_TTL, dns_neg_ttl = DEFAULT_DNS_NEG_TTL;
+	char *hosts_file = NULL, *disk_dir = NULL, *log_file = NULL;
+	int level = LOG_WARN;
+	unsigned long long disk_size = DEFAULT_DISK_SIZE, shm_size = DEFAULT_SHM_SIZE;
+	int processes = 1, shared = 0;
+	char disk_path[MAXLINE];
+	int c, i;
+	
+	static struct option long_opts[] = {
+		{"mode", required_argument, NULL, 'm'},
+		{"loops", required_argument, NULL, 'l'},
+		{"workers", required_argument, NULL, 'w'},
+		{"queue", required_argument, NULL, 'q'},
+		{"overflow", required_argument, NULL, 'o'},
+		{"cache-shards", required_argument, NULL, 's'},
+		{"cache-policy", required_argument, NULL, 'p'},
+		{"cache-admission", required_argument, NULL, 'a'},
+		{"upstream-per-host", required_argument, NULL, 'u'},
+		{"upstream-idle", required_argument, NULL, 'i'},
+		{"upstream-max-idle", required_argument, NULL, 'I'},
+		{"client-idle", required_argument, NULL, 'c'},
+		{"dns-ttl", required_argument, NULL, 'd'},
+		{"dns-neg-ttl", required_argument, NULL, 'n'},
+		{"hosts", required_argument, NULL, 'H'},
+		{"disk-cache", required_argument, NULL, 'D'},
+		{"disk-size", required_argument, NULL, 'S'},
+		{"splice", required_argument, NULL, 'z'},
+		{"log", required_argument, NULL, 'L'},
+		{"log-level", required_argument, NULL, 'v'},
+		{"processes", required_argument, NULL, 'P'},
+		{"process-cache", required_argument, NULL, 'C'},
+		{"shared-cache-size", required_argument, NULL, 'M'},
+		{NULL, 0, NULL, 0}
+	};
+	
+	while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			if (!strcmp(optarg, "threads"))
+				mode = MODE_THREADS;
+			else if (!strcmp(optarg, "events"))
+				mode = MODE_EVENTS;
+			else
+				usage();
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'w':
+			if ((workers = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'q':
+			if ((queue = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'o':
+			if (!strcmp(optarg, "block"))
+				overflow = SBUF_BLOCK;
+			else if (!strcmp(optarg, "reject"))
+				overflow = SBUF_REJECT;
+			else
+				usage();
+			break;
+		case 's':
+			if ((shards = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'p':
+			if (!(policy = find_policy(optarg)))
+				usage();
+			break;
+		case 'a':
+			if (!strcmp(optarg, "tinylfu"))
+				admission = 1;
+			else if (!strcmp(optarg, "all"))
+				admission = 0;
+			else
+				usage();
+			break;
+		case 'u':
+			if ((pool_per_host = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'i':
+			if ((pool_idle = atoi(optarg)) <= 0)
+				usage();
+			break;
+		case 'I':
+			if ((pool_max_idle = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'c':
+			if ((client_idle = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'd':
+			if ((dns_ttl = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'n':
+			if ((dns_neg_ttl = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'H':
+			hosts_file = optarg;
+			break;
+		case 'D':
+			disk_dir = optarg;
+			break;
+		case 'S':
+			if ((disk_size = strtoull(optarg, NULL, 10)) == 0 || disk_size > DISK_MAX_SIZE)
+				usage();
+			break;
+		case 'z':
+			if (!strcmp(optarg, "on"))
+				splice_enabled = 1;
+			else if (!strcmp(optarg, "off"))
+				splice_enabled = 0;
+			else
+				usage();
+			break;
+		case 'L':
+			log_file = optarg;
+			break;
+		case 'v':
+			if ((level = log_find_level(optarg)) == -1)
+				usage();
+			break;
+		case 'P':
+			if ((processes = atoi(optarg)) <= 0 || processes > MAX_PROCS)
+				usage();
+			break;
+		case 'C':
+			if (!strcmp(optarg, "private"))
+				shared = 0;
+			else if (!strcmp(optarg, "shared"))
+				shared = 1;
+			else
+				usage();
+			break;
+		case 'M':
+			if ((shm_size = strtoull(optarg, NULL, 10)) == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc || (shared && processes == 1))
+		usage();
 	
-	port = atoi(argv[1]);
+	port = atoi(argv[optind]);
 	if (port < MIN_PORT_NUMBER || port > MAX_PORT_NUMBER){
 		printf("invalid port number");
 		exit(1);
 	}
 	
-	list = cache_init();
+	if (processes > 1) {
+		/* the shared tier must exist before the fork to be shared */
+		if (shared && !(shared_cache = shm_create(shm_size << 20))) {
+			fprintf(stderr, "cannot map a %lluMB shared cache\n", shm_size);
+			exit(1);
+		}
+		procs_start(processes);
+		/* each worker is pinned to one core */
+		if (!loops)
+			loops = 1;
+	}
+	
+	if (log_init(log_file, level) == -1) {
+		fprintf(stderr, "cannot open log file %s\n", log_file);
+		exit(1);
+	}
+	list = cache_init(shards, policy, admission);
+	if (disk_dir) {
+		/* every worker gets its own directory and share of the size */
+		if (proc_index >= 0) {
+			snprintf(disk_path, sizeof(disk_path), "%s/%d", disk_dir, proc_index);
+			mkdir(disk_path, 0755);
+			disk_dir = disk_path;
+			disk_size /= processes;
+		}
+		if (disk_init(&disk, disk_dir, disk_size << 20) == -1) {
+			fprintf(stderr, "cannot use disk cache directory %s\n", disk_dir);
+			exit(1);
+		}
+		list->disk = &disk;
+	}
+	if (dns_init(&dns, dns_ttl, dns_neg_ttl, hosts_file) == -1) {
+		fprintf(stderr, "cannot read hosts file %s\n", hosts_file);
+		exit(1);
+	}
+	connpool_init(&pool, pool_per_host, pool_max_idle, pool_idle, &dns);
+	collapse_init(&collapse);
 	
     Signal(SIGPIPE, SIG_IGN);
 	
-	listenfd = Open_listenfd(port);
-	while (1){
+	if (proc_index < 0)
+		listenfd = Open_listenfd(port);
+	else if ((listenfd = procs_listenfd(port)) < 0) {
+		fprintf(stderr, "cannot listen on port %d: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	
+	if (mode == MODE_EVENTS)
+		event_loop_run(listenfd, loops);
+	
+	if (!queue)
+		queue = QUEUE_PER_WORKER * workers;
+	sbuf_init(&sbuf, queue, overflow);
+	sbuf.workers = workers;
+	for (i = 0; i < workers; i++) {
 		pthread_t tid;
-		int *connfdp = Malloc(sizeof(int));
-		*connfdp = -1;
-		*connfdp = Accept(listenfd, (SA *) &clientaddr, (socklen_t *)&clientlen);
-		Pthread_create(&tid, NULL, (void *)handle_client, (void *)connfdp);
+		Pthread_create(&tid, NULL, worker, NULL);
+	}
+	
+	while (1){
+		int connfd = Accept(listenfd, (SA *) &clientaddr, (socklen_t *)&clientlen);
+		if (sbuf_insert(&sbuf, connfd) == -1) {
+			/* queue full in reject mode: turn the client away right here */
+			rio_writen(connfd, (void *)busy_str, strlen(busy_str));
+			Close(connfd);
+		}
 	}
 	
+	sbuf_deinit(&sbuf);
 	cache_destruct(list);
 	return 0;
 }
 
 
-void handle_client(int *varg){
-	printf("pid: %u\n",(unsigned int)Pthread_self());
+void usage() {
+	fprintf(stderr, "usage: proxy <port> [--mode=threads|events] [--loops=<n>]\n");
+	fprintf(stderr, "             [--workers=<n>] [--queue=<n>] [--overflow=block|reject]\n");
+	fprintf(stderr, "             [--cache-shards=<n>] [--cache-policy=clock|gdsf] [--cache-admission=all|tinylfu]\n");
+	fprintf(stderr, "             [--upstream-per-host=<n>] [--upstream-idle=<s>] [--upstream-max-idle=<n>]\n");
+	fprintf(stderr, "             [--client-idle=<s>] [--dns-ttl=<s>] [--dns-neg-ttl=<s>] [--hosts=<file>]\n");
+	fprintf(stderr, "             [--disk-cache=<dir>] [--disk-size=<MB>] [--splice=on|off]\n");
+	fprintf(stderr, "             [--log=<file>] [--log-level=error|warn|info|debug]\n");
+	fprintf(stderr, "             [--processes=<n>] [--process-cache=private|shared] [--shared-cache-size=<MB>]\n");
+	fprintf(stderr, "  --mode=threads  pool of worker threads (default)\n");
+	fprintf(stderr, "  --mode=events   non-blocking epoll loops\n");
+	fprintf(stderr, "  --loops=<n>     number of epoll loops (default: one per core)\n");
+	fprintf(stderr, "  --workers=<n>   worker threads (default: %d)\n", DEFAULT_WORKERS);
+	fprintf(stderr, "  --queue=<n>     accepted connections waiting for a worker (default: %d per worker)\n", QUEUE_PER_WORKER);
+	fprintf(stderr, "  --overflow=block   stop accepting while the queue is full (default)\n");
+	fprintf(stderr, "  --overflow=reject  answer 503 while the queue is full\n");
+	fprintf(stderr, "  --cache-shards=<n> independently locked cache shards (default: %d, at most %d)\n",
+		CACHE_SHARDS, MAX_CACHE_SIZE / MAX_OBJECT_SIZE);
+	fprintf(stderr, "  --cache-policy=gdsf      evict large, rarely hit objects first (default)\n");
+	fprintf(stderr, "  --cache-policy=clock     evict objects not hit since the last sweep\n");
+	fprintf(stderr, "  --cache-admission=tinylfu  cache a new object only if it is requested more\n");
+	fprintf(stderr, "                           often than what it would evict (default)\n");
+	fprintf(stderr, "  --cache-admission=all    cache every object that fits\n");
+	fprintf(stderr, "  --upstream-per-host=<n>  idle keep-alive connections kept per origin\n");
+	fprintf(stderr, "                           (default: %d, 0 sends HTTP/1.0 with Connection: close)\n", DEFAULT_POOL_PER_HOST);
+	fprintf(stderr, "  --upstream-idle=<s>      seconds an idle upstream connection is kept (default: %d)\n", DEFAULT_POOL_IDLE);
+	fprintf(stderr, "  --upstream-max-idle=<n>  idle upstream connections kept across all origins (default: %d)\n", DEFAULT_POOL_MAX_IDLE);
+	fprintf(stderr, "  --client-idle=<s>        seconds a keep-alive client may wait between requests\n");
+	fprintf(stderr, "                           (default: %d, 0 closes after every response)\n", DEFAULT_CLIENT_IDLE);
+	fprintf(stderr, "  --dns-ttl=<s>            seconds a resolved origin address is reused (default: %d)\n", DEFAULT_DNS_TTL);
+	fprintf(stderr, "  --dns-neg-ttl=<s>        seconds a failed lookup is remembered (default: %d)\n", DEFAULT_DNS_NEG_TTL);
+	fprintf(stderr, "  --hosts=<file>           \"address name...\" lines that override the resolver\n");
+	fprintf(stderr, "  --disk-cache=<dir>       keep objects evicted from memory in segment files in <dir>\n");
+	fprintf(stderr, "  --disk-size=<MB>         size of the disk cache (default: %d, at most %d)\n",
+		DEFAULT_DISK_SIZE, DISK_MAX_SIZE);
+	fprintf(stderr, "  --splice=on|off          splice bodies that are not cached straight to the client (default: on)\n");
+	fprintf(stderr, "  --log=<file>             append log records to <file> instead of stderr\n");
+	fprintf(stderr, "  --log-level=<level>      error, warn (default), info adds one access record per\n");
+	fprintf(stderr, "                           request, debug adds upstream connection events\n");
+	fprintf(stderr, "  --processes=<n>          fork n workers, each pinned to a core with its own\n");
+	fprintf(stderr, "                           SO_REUSEPORT listener and caches (default: 1, at most %d)\n", MAX_PROCS);
+	fprintf(stderr, "  --process-cache=private  every worker caches on its own (default)\n");
+	fprintf(stderr, "  --process-cache=shared   workers also share a cache tier in shared memory\n");
+	fprintf(stderr, "  --shared-cache-size=<MB> size of the shared tier (default: %d)\n", DEFAULT_SHM_SIZE);
+	exit(1);
+}
+
+
+void *worker(void *vargp) {
 	Pthread_detach(Pthread_self());
 	
-	int client_fd = (int)(*varg);
-	int server_fd = -1;
+	while (1) {
+		int connfd = sbuf_remove(&sbuf);
+		handle_client(connfd);
+		sbuf_done(&sbuf);
+	}
+	return NULL;
+}
+
+/* 
+ * handle_client - serve requests on one client connection until the client
+ * or a response asks to close, or the client stays idle for client_idle
+ * seconds. Pipelined requests are read from the same rio buffer and
+ * answered in order.
+ */
+void handle_client(int client_fd){
+	rio_t rio_client;
+	struct timeval timeout;
+	int one = 1;
 	
-	char tmp_str[MAXBUF];
+	/* a response goes out in several writes; without this, the second
+	   waits for the client's delayed ACK on every kept-alive request */
+	setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (client_idle) {
+		timeout.tv_sec = client_idle;
+		timeout.tv_usec = 0;
+		setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	}
+	
+	stats_add(STAT_CONN_OPENED, 1);
+	procs_add(1, 0);
+	Rio_readinitb(&rio_client, client_fd);
+	while (serve_request(&rio_client, client_fd))
+		;
 	
-	char request_str[MAXBUF];
+	Close(client_fd);
+	stats_add(STAT_CONN_CLOSED, 1);
+}
+
+/* serve_request - answer one request; returns 1 if the connection stays open */
+int serve_request(rio_t *rio_client, int client_fd){
+	int server_fd = -1;
+	int keep_alive, credentials, minor;
+	
+	HttpOut out;
 	char host[MAXBUF], port[MAXBUF], resource[MAXBUF];
-	char cache_index[MAXBUF], content[MAX_OBJECT_SIZE];
+	char cache_index[MAXBUF];
+	
+	int r_value = read_request(rio_client, &out, host, port, cache_index, resource, &keep_alive, &credentials, &minor);
+	
+	if (r_value == -1)
+		return 0;
+	
+	if (!client_idle)
+		keep_alive = 0;
 	
-	unsigned int len;
+	if (r_value == 2)
+		return serve_pool_stats(client_fd, keep_alive);
+	if (r_value == 3)
+		return serve_stats(client_fd, keep_alive, strstr(resource, "json") != NULL);
+	
+	if (r_value)
+		return 0;
 	
-	int r_value = read_request(request_str, client_fd, host, port, cache_index, resource);
+	unsigned long long start = stats_now(), sent = stats_local(STAT_BYTES_OUT);
+	const char *result = "miss";
+	time_t now = time(NULL), expires;
+	char validators[MAXBUF];
+	DiskRef ref;
+	CacheObject *object = cache_lookup(list, cache_index);
+	int on_disk = !object && list->disk && disk_lookup(list->disk, cache_index, cache_hash(cache_index), &ref) == 0;
+	Buf *shared = !object && !on_disk && shared_cache ? buf_get(MAX_OBJECT_SIZE) : NULL;
+	int shared_len = shared ?
+		shm_get(shared_cache, cache_index, cache_hash(cache_index), shared->data, MAX_OBJECT_SIZE, &expires) : -1;
 	
-	printf("Read data from %s:%s\n",host,port);
-	fflush(stdout);
+	stats_add(STAT_REQUESTS, 1);
+	procs_add(0, 1);
+	stats_time(TIMER_LOOKUP, start);
 	
-	if (!r_value) {
-		if (!read_node_content(list, cache_index, content, &len)) {
-			printf("cache hit!\n");
-			if (forward_content_to_client(client_fd, content, len) == -1)
-				fprintf(stderr, "forward content to client error.\n");
-			Close(client_fd);
-			return;
+	if (object && cache_fresh(object, now)) {
+		stats_add(STAT_HITS, 1);
+		result = "hit";
+		if (forward_cached_to_client(client_fd, object, &keep_alive) == -1) {
+			LOG(LOG_WARN, "msg=\"forward content to client error\" url=%s", cache_index);
+			result = "error";
+			stats_add(STAT_ERRORS, 1);
+			keep_alive = 0;
 		}
-		else {
-			int server_value = forward_to_server(host, port, &server_fd, request_str);
-			if (server_value == -1){
-				fprintf(stderr, "forward content to server error.\n");
-				strcpy(tmp_str, fail_str);
-				Rio_writen(client_fd, tmp_str, strlen(fail_str));
+		cache_release(object);
+		goto done;
+	}
+	
+	if (on_disk) {
+		/* back into memory, as fresh as when it left; whatever that evicts takes its place on disk */
+		if ((expires = ref.expires) != -1)
+			insert_content_node(list, cache_index, ref.data, ref.length, expires);
+		if (expires > now) {
+			stats_add(STAT_DISK_HITS, 1);
+			result = "disk";
+			if (forward_disk_to_client(client_fd, &ref, &keep_alive) == -1) {
+				LOG(LOG_WARN, "msg=\"forward content to client error\" url=%s", cache_index);
+				result = "error";
+				stats_add(STAT_ERRORS, 1);
+				keep_alive = 0;
 			}
-			else if (server_value == -2) {
-				fprintf(stderr, "forward content to server error(dns look up fail).\n");
-				strcpy(tmp_str, fail_str);
-				Rio_writen(client_fd, tmp_str, strlen(fail_str));
+			disk_release(list->disk, &ref);
+			goto done;
+		}
+		/* stale: revalidate the copy just promoted */
+		disk_release(list->disk, &ref);
+		if (expires != -1)
+			object = cache_lookup(list, cache_index);
+	}
+	
+	if (shared_len >= 0) {
+		/* into this worker's memory cache; served from the copy in case it is not admitted */
+		insert_content_node(list, cache_index, shared->data, shared_len, expires);
+		if (expires > now) {
+			stats_add(STAT_SHARED_HITS, 1);
+			result = "shared";
+			if (forward_stored_to_client(client_fd, shared->data, shared_len, NULL, &keep_alive) == -1) {
+				LOG(LOG_WARN, "msg=\"forward content to client error\" url=%s", cache_index);
+				result = "error";
+				stats_add(STAT_ERRORS, 1);
+				keep_alive = 0;
 			}
-			else {	
-				int f_value = read_and_forward_response(server_fd, client_fd, cache_index, content);
-				if (f_value == -1)
-					fprintf(stderr, "forward content to client error.\n");
-				else if (f_value == -2 && list)
-					fprintf(stderr, "save content to cache error.\n");
+			buf_put(shared);
+			goto done;
+		}
+		object = cache_lookup(list, cache_index);
+	}
+	buf_put(shared);
+	
+	/* a stale hit becomes a conditional request; without validators, a plain miss */
+	if (object && !http_add_validators(&out, object->data, object->length, validators, sizeof(validators))) {
+		cache_release(object);
+		object = NULL;
+	}
+	
+	int server_value, f_value, reused, reusable = 0, leader, fresh;
+	Pending *pending = NULL;
+	Reader reader;
+	
+	/* a response to someone's credentials is theirs alone, so it is not shared in flight either */
+	if (!object && !credentials)
+		pending = collapse_begin(&collapse, cache_index, &leader, &reader);
+	
+	if (pending && !leader) {
+		/* someone is already fetching this: stream their response */
+		f_value = forward_collapsed_to_client(client_fd, minor, pending, &reader, &keep_alive);
+		collapse_leave(&collapse, pending, &reader);
+		if (f_value != -3) {
+			stats_add(STAT_COLLAPSED, 1);
+			result = "collapsed";
+			if (f_value) {
+				LOG(LOG_WARN, "msg=\"forward content to client error\" url=%s", cache_index);
+				result = "error";
+				stats_add(STAT_ERRORS, 1);
+				keep_alive = 0;
 			}
+			goto done;
+		}
+		pending = NULL;
+	}
+	
+	/* a pooled connection the server already closed gets one retry, on a new connection */
+	for (fresh = 0; ; fresh = 1) {
+		if (server_fd >= 0)
+			Close(server_fd);
+		server_fd = -1;
+		server_value = forward_to_server(host, port, fresh, &server_fd, &out, &reused);
+		if (server_value)
+			break;
+		f_value = read_and_forward_response(server_fd, client_fd, minor, credentials, cache_index, &reusable, &keep_alive, pending, object);
+		if (f_value != -3 || !reused || fresh)
+			break;
+	}
+	
+	stats_add(object && !server_value && f_value == 1 ? STAT_REVALIDATED : STAT_MISSES, 1);
+	if (object) {
+		__atomic_add_fetch(&revalidations, 1, __ATOMIC_RELAXED);
+		if (!server_value && f_value == 1) {
+			result = "revalidated";
+			__atomic_add_fetch(&not_modified, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&bytes_saved, object->length, __ATOMIC_RELAXED);
+			if (forward_cached_to_client(client_fd, object, &keep_alive) == -1)
+				f_value = -1;
+		}
+		cache_release(object);
+	}
+	
+	if (server_value || f_value == -1 || f_value == -3) {
+		stats_add(STAT_ERRORS, 1);
+		result = "error";
+	}
+	if (server_value == -1){
+		LOG(LOG_WARN, "msg=\"forward content to server error\" url=%s", cache_index);
+		Rio_writen(client_fd, (char *)fail_str, strlen(fail_str));
+		keep_alive = 0;
+	}
+	else if (server_value == -2) {
+		LOG(LOG_WARN, "msg=\"dns lookup failed\" host=%s", host);
+		Rio_writen(client_fd, (char *)fail_str, strlen(fail_str));
+		keep_alive = 0;
+	}
+	else {	
+		if (f_value == -1 || f_value == -3) {
+			LOG(LOG_WARN, "msg=\"forward content to client error\" url=%s", cache_index);
+			keep_alive = 0;
+		}
+		else if (f_value == -2 && list)
+			LOG(LOG_WARN, "msg=\"save content to cache error\" url=%s", cache_index);
+		if (reusable) {
+			connpool_put(&pool, host, port, server_fd);
+			server_fd = -1;
 		}
-		close_fd(&client_fd, &server_fd);
 	}
+	close_fd(NULL, &server_fd);
+	if (pending)
+		collapse_end(&collapse, pending, !server_value && (f_value == 0 || f_value == -2));
 	
-    	return;
+done:
+	stats_time(TIMER_TOTAL, start);
+	LOG(LOG_INFO, "event=access url=%s result=%s bytes=%llu us=%llu", cache_index, result,
+		stats_local(STAT_BYTES_OUT) - sent, (stats_now() - start) / 1000);
+	return keep_alive;
 }
 
-int read_request(char *str, int client_fd, char *host, char *port, char *cache_index, char *resource) {
-	char tmpstr[MAXBUF];
-	char method[MAXBUF], protocol[MAXBUF], host_port[MAXBUF];
-	char version[MAXBUF];
+/* 
+ * serve_pool_stats - answer "GET /__pool" sent to the proxy itself with
+ * worker occupancy, queue-wait, upstream connection reuse, DNS cache,
+ * collapsed forwarding and disk cache numbers.
+ * Returns 1 if the connection stays open.
+ */
+int serve_pool_stats(int client_fd, int keep_alive) {
+	char body[MAXBUF], header[MAXBUF];
+	int len;
 	
-	rio_t rio_client;
+	len = sbuf_stats(&sbuf, body, sizeof(body));
+	len += connpool_stats(&pool, body + len, sizeof(body) - len);
+	len += dns_stats(&dns, body + len, sizeof(body) - len);
+	len += collapse_stats(&collapse, body + len, sizeof(body) - len);
+	if (list->disk)
+		len += disk_stats(list->disk, body + len, sizeof(body) - len);
+	len += splice_stats(body + len, sizeof(body) - len);
+	len += log_stats(body + len, sizeof(body) - len);
+	len += bufpool_stats(body + len, sizeof(body) - len);
+	if (shared_cache)
+		len += shm_stats(shared_cache, body + len, sizeof(body) - len);
+	len += snprintf(body + len, sizeof(body) - len,
+		"revalidations: %lu\nrevalidated_304: %lu\nrevalidation_304_ratio: %.2f\nrevalidation_bytes_saved: %llu\n",
+		revalidations, not_modified, revalidations ? (double)not_modified / revalidations : 0.0, bytes_saved);
+	sprintf(header, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n%s\r\n",
+		len, keep_alive ? keep_alive_connection : close_connection);
+	if (rio_writen(client_fd, header, strlen(header)) == -1 || rio_writen(client_fd, body, len) == -1)
+		return 0;
+	return keep_alive;
+}
+
+/* serve_stats - answer "GET /__stats" (text) or "GET /__stats?format=json" */
+int serve_stats(int client_fd, int keep_alive, int json) {
+	char page[2 * MAXBUF];
+	int len = stats_page(page, sizeof(page), json, keep_alive ? keep_alive_connection : close_connection);
 	
-	Rio_readinitb(&rio_client, client_fd);
-	if (Rio_readlineb(&rio_client, tmpstr, MAXBUF) == -1)
-		return -1;
+	if (rio_writen(client_fd, page, len) == -1)
+		return 0;
+	return keep_alive;
+}
+
+/* 
+ * read_request - parse one request from rio_client's buffer and rewrite it
+ * into out. *keep_alive is set when the client wants the connection kept
+ * open and *credentials when it carries Authorization or Cookie; *minor is
+ * its HTTP/1.<minor> version. out refers to rio_client's buffer and is
+ * valid until it is read again.
+ * Returns -1 on EOF, timeout or a malformed request, 1 for methods other
+ * than GET and 2 for the proxy's own status page.
+ */
+int read_request(rio_t *rio_client, HttpOut *out, char *host, char *port, char *cache_index, char *resource, int *keep_alive, int *credentials, int *minor) {
+	HttpRequest req;
+	int r_value;
 	
-	if (parse_request(tmpstr, method, protocol, host_port, resource, version) == -1)
+	if (http_read_request(rio_client, &req) == -1)
 		return -1;
 	
-	get_host_and_port(host_port, host, port);
+	*keep_alive = http_keep_alive(&req);
+	*credentials = http_credentials(&req);
+	*minor = req.minor;
 	
-	if (strstr(method, "GET")) {
-		strcpy(str, method);
-		strcat(str, " ");
-		strcat(str, resource);
-		strcat(str, " ");
-		strcat(str, init_version);
-		
-		if(strlen(host))
-		{
-			strcpy(tmpstr, "Host: ");
-			strcat(tmpstr, host);
-			strcat(tmpstr, ":");
-			strcat(tmpstr, port);
-			strcat(tmpstr, "\r\n");
-			strcat(str, tmpstr);
-		}
-		
-		strcat(str, user_agent_hdr);
-		strcat(str, accept_str);
-		strcat(str, accept_encoding);
-		strcat(str, connection);
-		strcat(str, proxy_connection);
-		
-		while(Rio_readlineb(&rio_client, tmpstr, MAXBUF) > 0) {
-			if (!strcmp(tmpstr, "\r\n")){
-				strcat(str,"\r\n");
-				break;
-			}
-			else if(strstr(tmpstr, "User-Agent:") || strstr(tmpstr, "Accept:") ||
-				strstr(tmpstr, "Accept-Encoding:") || strstr(tmpstr, "Connection:") ||
-				strstr(tmpstr, "Proxy Connection:") || strstr(tmpstr, "Cookie:"))
-				continue;
-			else if (strstr(tmpstr, "Host:")) {
-				if (!strlen(host)) {
-					sscanf(tmpstr, "Host: %s", host_port);
-					get_host_and_port(host_port, host, port);
-					strcpy(tmpstr, "Host: ");
-					strcat(tmpstr, host);
-					strcat(tmpstr, ":");
-					strcat(tmpstr, port);
-					strcat(tmpstr, "\r\n");
-					strcat(str, tmpstr);
-				}
-			}
-			else
-				strcat(str, tmpstr);
-		}
-		
-		strcpy(cache_index, host);
-		strcat(cache_index, ":");
-		strcat(cache_index, port);
-		strcat(cache_index, resource);
-		
-		return 0;
-	}
+	if ((r_value = http_rewrite_request(&req, out, host, port, resource, pool.max_per_host > 0)))
+		return r_value;
 	
-	return 1;
+	/* origin-form request for the proxy's own status page */
+	if (req.target.p[0] == '/' && !strcmp(resource, POOL_STATS_PATH))
+		return 2;
+	if (http_own_path(&req, resource, STATS_PATH))
+		return 3;
+	
+	make_cache_index(cache_index, host, port, resource);
+	return 0;
 }
 
-int forward_to_server(char *host, char *port, int *server_fd, char *request_str) {
-	*server_fd = Open_clientfd(host, atoi(port));
+int forward_to_server(char *host, char *port, int fresh, int *server_fd, HttpOut *out, int *reused) {
+	unsigned long long start = stats_now();
+	
+	*server_fd = connpool_get(&pool, host, port, fresh, reused);
 	
 	if (*server_fd < 0) {
 		if (*server_fd == -1)
@@ -202,128 +675,457 @@ int forward_to_server(char *host, char *port, int *server_fd, char *request_str)
 		else 
 			return -2;
 	}
-	if(Rio_writen(*server_fd, request_str, strlen(request_str)) == -1)
+	if (!*reused)
+		stats_time(TIMER_CONNECT, start);
+	LOG(LOG_DEBUG, "event=upstream host=%s port=%s reused=%d us=%llu", host, port, *reused,
+		(stats_now() - start) / 1000);
+	if (http_writev(*server_fd, out->iov, out->iovcnt) == -1)
 		return -1;
 	
+	/* time to first byte runs from here */
+	stats_mark();
 	return 0;
 }
 
-int forward_content_to_client(int client_fd, char *content, unsigned int len) {
-	if (Rio_writen(client_fd, content, len) == -1)
+/* 
+ * forward_cached_to_client - write a cached response with the proxy's
+ * Connection header spliced in before the blank line. *keep_alive is
+ * cleared if the cached response has no length framing.
+ */
+int forward_cached_to_client(int client_fd, CacheObject *object, int *keep_alive) {
+	return forward_stored_to_client(client_fd, object->data, object->length, NULL, keep_alive);
+}
+
+/* forward_disk_to_client - the same for an object pinned in the disk cache */
+int forward_disk_to_client(int client_fd, DiskRef *ref, int *keep_alive) {
+	return forward_stored_to_client(client_fd, ref->data, ref->length, ref, keep_alive);
+}
+
+/* 
+ * forward_stored_to_client - write a stored response. The header, the
+ * Connection line and, unless it is sent from disk with sendfile, the
+ * body go out in one writev.
+ */
+int forward_stored_to_client(int client_fd, char *data, unsigned int length, DiskRef *ref, int *keep_alive) {
+	struct iovec iov[3];
+	unsigned int head = 0;
+	int framed, iovcnt = 0;
+	const char *conn;
+	
+	if ((framed = response_head(data, length, &head)) == -1)
+		*keep_alive = 0;
+	else {
+		if (!framed)
+			*keep_alive = 0;
+		conn = *keep_alive ? keep_alive_connection : close_connection;
+		iov[0].iov_base = data;
+		iov[0].iov_len = head;
+		iov[1].iov_base = (char *)conn;
+		iov[1].iov_len = strlen(conn);
+		iovcnt = 2;
+	}
+	if (!ref) {
+		iov[iovcnt].iov_base = data + head;
+		iov[iovcnt++].iov_len = length - head;
+	}
+	if (iovcnt && http_writev(client_fd, iov, iovcnt) == -1)
 		return -1;
-		
+	if (ref && disk_send(client_fd, ref, head) == -1)
+		return -1;
+	stats_add(STAT_BYTES_OUT, length);
+	stats_add(STAT_BYTES_HIT, length);
 	return 0;
 }
 
-int read_and_forward_response(int server_fd, int client_fd, 
-		char *cache_index, char *content) {
-		
-	rio_t rio_server;
+/* 
+ * forward_collapsed_to_client - stream the response another thread is
+ * fetching for the same cache index through reader, adding this client's
+ * Connection header. Returns -3 if that response is not shared (the fetch
+ * failed before producing a header, or the header is not storable) or is
+ * chunked for an HTTP/1.0 client, so the caller can fetch on its own, -4
+ * if it failed midway or this client fell too far behind, and -1 on
+ * client write errors.
+ */
+int forward_collapsed_to_client(int client_fd, int client_minor, Pending *pending, Reader *reader, int *keep_alive) {
 	char tmp_str[MAXBUF];
-	unsigned int size = 0, len = 0, cache_size = 0;
-	int valid_size = 1;
+	struct iovec iov[3];
+	unsigned int head, room = 0;
+	unsigned long long off = 0;
+	int n, framed, iovcnt = 0;
+	const char *conn;
+	
+	if ((n = collapse_head(&collapse, pending, reader, tmp_str, MAXBUF)) == -1)
+		return -3;
+	if (n == 0 || (framed = response_head(tmp_str, n, &head)) == -1)
+		*keep_alive = 0;
+	else {
+		/* the leader relays chunks as they come; only its own client gets them de-chunked */
+		if (framed == 2 && client_minor == 0)
+			return -3;
+		if (!framed)
+			*keep_alive = 0;
+		conn = *keep_alive ? keep_alive_connection : close_connection;
+		iov[0].iov_base = tmp_str;
+		iov[0].iov_len = head;
+		iov[1].iov_base = (char *)conn;
+		iov[1].iov_len = strlen(conn);
+		iovcnt = 2;
+		off = head;
+		/* the blank line is already buffered, so the header waits for no body bytes */
+		room = head;
+	}
+	
+	/* the first read lands after the header and is written with it */
+	while ((n = collapse_read(&collapse, pending, reader, tmp_str + room, MAXBUF - room)) > 0) {
+		iov[iovcnt].iov_base = tmp_str + room;
+		iov[iovcnt++].iov_len = n;
+		if (http_writev(client_fd, iov, iovcnt) == -1)
+			return -1;
+		off += n;
+		iovcnt = 0;
+		room = 0;
+	}
+	if (iovcnt && http_writev(client_fd, iov, iovcnt) == -1)
+		return -1;
+	stats_add(STAT_BYTES_OUT, off);
+	return n ? -4 : 0;
+}
+
+/* 
+ * response_head - find the end of a response header. *head is set past the
+ * CRLF of the last header line. Returns 2 if the body is chunked, 1 if it
+ * is framed by length or status, 0 if it ends at connection close, -1
+ * without a complete header.
+ */
+int response_head(char *data, unsigned int len, unsigned int *head) {
+	char *end, *line;
+	int framed = 0, status = 0;
+	
+	end = memmem(data, len, "\r\n\r\n", 4);
+	if (!end)
+		return -1;
+	*head = end - data + 2;
+	
+	sscanf(data, "HTTP/1.%*d %d", &status);
+	if (status / 100 == 1 || status == 204 || status == 304)
+		framed = 1;
+	for (line = memchr(data, '\n', *head); line && line < end; line = memchr(line, '\n', end - line)) {
+		line++;
+		if (!strncasecmp(line, "Transfer-Encoding:", 18) && memmem(line, end - line, "chunked", 7))
+			return 2;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			framed = 1;
+	}
+	return framed;
+}
+
+/* hop_by_hop - headers that describe the server connection, not the response */
+int hop_by_hop(char *line) {
+	return !strncasecmp(line, "Connection:", 11) || !strncasecmp(line, "Keep-Alive:", 11) ||
+		!strncasecmp(line, "Proxy-Connection:", 17);
+}
+
+/* 
+ * read_and_forward_response - relay one response, framed by Content-Length,
+ * chunked encoding or connection close, to a client speaking
+ * HTTP/1.<client_minor>. Interim 1xx responses before it are passed on to
+ * HTTP/1.1 clients and dropped for HTTP/1.0 ones. *reusable is set when
+ * the whole final response was read and the server keeps the connection open.
+ * The response to a request with credentials is only cached if http_public
+ * allows it.
+ * Hop-by-hop headers are replaced by the proxy's own Connection header;
+ * *client_keep_alive is cleared when the response is delimited by close.
+ * Everything relayed except that header is also published to pending, if
+ * given, for collapsed followers.
+ * For a revalidation of stale, a 304 is not relayed; it refreshes stale
+ * and 1 is returned so the caller serves it. Any other answer replaces it.
+ * A chunked body is relayed chunk by chunk as it arrives, but the copy
+ * kept for the cache is de-chunked and given a Content-Length instead.
+ * An HTTP/1.0 client gets it de-chunked too, delimited by close; pending
+ * still gets the chunks.
+ * Returns -3 if the server closed before sending anything (a stale pooled
+ * connection), -1 on other errors and -2 if caching failed.
+ */
+int read_and_forward_response(int server_fd, int client_fd, int client_minor, int credentials,
+		char *cache_index, int *reusable, int *client_keep_alive, Pending *pending, CacheObject *stale) {
+	Buf *io = buf_get(MAXBUF);
+	BufChain copy = {0};
+	int rc;
+	
+	rc = forward_response(server_fd, client_fd, client_minor, credentials, cache_index, io->data, &copy, reusable, client_keep_alive, pending, stale);
+	chain_free(&copy);
+	buf_put(io);
+	return rc;
+}
+
+/*
+ * forward_response - read_and_forward_response with its line buffer
+ * (MAXBUF bytes) and the chain the copy for the cache grows in.
+ */
+int forward_response(int server_fd, int client_fd, int client_minor, int credentials, char *cache_index, char *tmp_str, BufChain *copy,
+		int *reusable, int *client_keep_alive, Pending *pending, CacheObject *stale) {
+	rio_t rio_server;
+	unsigned long long size = 0;
+	unsigned int head_size = 0, chunk, left, data;
+	int len, minor = 0, status = 0, te_line = 0, no_copy = 0, dechunk = 0;
+	int valid_size = 1, has_length = 0, chunked = 0, keep_alive = 0, iovcnt;
+	struct iovec iov[CHAIN_MAX_IOV];
+	time_t expires = -1;
 	
-	content[0] = '\0';
+	*reusable = 0;
 	
 	Rio_readinitb(&rio_server, server_fd);
 	
-	do {
-		if(Rio_readlineb(&rio_server, tmp_str, MAXBUF) == -1)
+	if ((len = Rio_readlineb(&rio_server, tmp_str, MAXBUF)) <= 0)
+		return -3;
+	stats_since_mark(TIMER_TTFB);
+	sscanf(tmp_str, "HTTP/1.%d %d", &minor, &status);
+	
+	/* 100 Continue, 103 Early Hints and the like: header only, the final response follows */
+	while (status / 100 == 1 && status != 101) {
+		while (1) {
+			if (client_minor >= 1 && relay(client_fd, tmp_str, len, copy, &no_copy, NULL) == -1)
+				return -1;
+			if (!strcmp(tmp_str, "\r\n") || !strcmp(tmp_str, "\n"))
+				break;
+			if ((len = Rio_readlineb(&rio_server, tmp_str, MAXBUF)) <= 0)
+				return -1;
+		}
+		if ((len = Rio_readlineb(&rio_server, tmp_str, MAXBUF)) <= 0)
+			return -1;
+		status = 0;
+		sscanf(tmp_str, "HTTP/1.%d %d", &minor, &status);
+	}
+	/* the proxy never asks to switch protocols */
+	if (status == 101)
+		return -1;
+	keep_alive = (minor >= 1);
+	
+	if (stale && status == 304) {
+		/* not modified: only the header comes, and the cached copy is good again */
+		while (1) {
+			if (!append(copy, tmp_str, len))
+				return -1;
+			if (!strcmp(tmp_str, "\r\n") || !strcmp(tmp_str, "\n"))
+				break;
+			if ((len = Rio_readlineb(&rio_server, tmp_str, MAXBUF)) <= 0)
+				return -1;
+			if (!strncasecmp(tmp_str, "Connection:", 11)) {
+				if (strcasestr(tmp_str, "close"))
+					keep_alive = 0;
+				else if (strcasestr(tmp_str, "keep-alive"))
+					keep_alive = 1;
+			}
+		}
+		stats_add(STAT_BYTES_IN, copy->len);
+		cache_refresh(stale, http_refresh(chain_pullup(copy, copy->len), copy->len, stale->data, stale->length, time(NULL)));
+		*reusable = keep_alive;
+		return 1;
+	}
+	
+	while (1) {
+		if (!strcmp(tmp_str, "\r\n") || !strcmp(tmp_str, "\n")) {
+			dechunk = chunked && client_minor == 0;
+			if (dechunk || !(status == 204 || status == 304 || chunked || has_length))
+				*client_keep_alive = 0;
+			if (Rio_writen(client_fd, *client_keep_alive ? (char *)keep_alive_connection : (char *)close_connection,
+					strlen(*client_keep_alive ? keep_alive_connection : close_connection)) == -1)
+				return -1;
+			if (relay(client_fd, tmp_str, len, copy, &valid_size, pending) == -1)
+				return -1;
+			head_size = copy->len;
+			/* Cache-Control: no-store and the like end the copy here, and turn followers away */
+			if (valid_size && ((expires = http_expires(chain_pullup(copy, head_size), head_size, time(NULL))) == -1 ||
+					(credentials && !http_public(chain_pullup(copy, head_size), head_size)))) {
+				expires = -1;
+				valid_size = 0;
+				chain_free(copy);
+			}
+			if (pending)
+				collapse_share(&collapse, pending, expires != -1);
+			break;
+		}
+		/* the cached copy is stored de-chunked, so it leaves out the encoding, as does an HTTP/1.0 client */
+		if (!hop_by_hop(tmp_str) && relay(te_line && client_minor == 0 ? -1 : client_fd,
+				tmp_str, len, copy, te_line ? &no_copy : &valid_size, pending) == -1)
 			return -1;
 		
-		if(valid_size)
-			valid_size = append(content, tmp_str, strlen(tmp_str), &cache_size);
-			
-		if (strstr(tmp_str, "Content-length")) 
-			sscanf(tmp_str, "Content-length: %d", &size);
-
-		if (strstr(tmp_str, "Content-Length")) 
-			sscanf(tmp_str, "Content-Length: %d", &size);
-		
-		if (Rio_writen(client_fd, tmp_str, strlen(tmp_str)) == -1)
+		if ((len = Rio_readlineb(&rio_server, tmp_str, MAXBUF)) <= 0)
 			return -1;
-			
-	}while(strcmp(tmp_str, "\r\n") != 0 && strlen(tmp_str));
+		
+		te_line = 0;
+		if (!strncasecmp(tmp_str, "Content-Length:", 15)) {
+			size = strtoull(tmp_str + 15, NULL, 10);
+			has_length = 1;
+		}
+		else if (!strncasecmp(tmp_str, "Transfer-Encoding:", 18) && strcasestr(tmp_str, "chunked"))
+			chunked = te_line = 1;
+		else if (!strncasecmp(tmp_str, "Connection:", 11)) {
+			if (strcasestr(tmp_str, "close"))
+				keep_alive = 0;
+			else if (strcasestr(tmp_str, "keep-alive"))
+				keep_alive = 1;
+		}
+	}
 	
-	if(size) {
-		while(size > MAXBUF) {
-			if((len = Rio_readnb(&rio_server, tmp_str, MAXBUF)) == -1)
+	/* known too large: don't start a copy that would be thrown away */
+	if (has_length && valid_size && copy->len + size > MAX_OBJECT_SIZE) {
+		valid_size = 0;
+		chain_free(copy);
+	}
+	
+	if (status == 204 || status == 304)
+		;	/* no body */
+	else if (chunked) {
+		/* the client gets the chunks as they are (or just their data); only their data goes into the copy */
+		while (1) {
+			if ((len = Rio_readlineb(&rio_server, tmp_str, MAXBUF)) <= 0)
 				return -1;
-				
-			if(valid_size)
-				valid_size = append(content, tmp_str, MAXBUF, &cache_size); 
-			if (Rio_writen(client_fd, tmp_str, len) == -1)
+			if (relay(dechunk ? -1 : client_fd, tmp_str, len, copy, &no_copy, pending) == -1)
 				return -1;
 			
-			size -= MAXBUF;
+			if (!(chunk = strtoul(tmp_str, NULL, 16)))
+				break;
+			/* chunk data plus its trailing CRLF; small chunks are cheaper to copy out of rio's buffer */
+			left = chunk + 2;
+			if (chunk + 2 > MAXBUF && can_splice(valid_size, pending, chunk + 2)) {
+				if (splice_body(&rio_server, client_fd, dechunk ? chunk : chunk + 2) == -1)
+					return -1;
+				left = dechunk ? 2 : 0;
+			}
+			for (; left > 0; left -= len) {
+				if ((len = Rio_readnb(&rio_server, tmp_str, left > MAXBUF ? MAXBUF : left)) <= 0)
+					return -1;
+				data = left > 2 ? left - 2 : 0;
+				data = len < data ? len : data;
+				if (dechunk) {
+					if (relay(client_fd, tmp_str, data, copy, &no_copy, pending) == -1 ||
+							relay(-1, tmp_str + data, len - data, copy, &no_copy, pending) == -1)
+						return -1;
+				}
+				else if (relay(client_fd, tmp_str, len, copy, &no_copy, pending) == -1)
+					return -1;
+				if (valid_size)
+					valid_size = append(copy, tmp_str, data);
+			}
 		}
-		
-		if(size) {
-			if((len = Rio_readnb(&rio_server, tmp_str, size)) == -1)
+		/* trailer section, up to the blank line; trailers are not kept */
+		do {
+			if ((len = Rio_readlineb(&rio_server, tmp_str, MAXBUF)) <= 0)
+				return -1;
+			if (relay(dechunk ? -1 : client_fd, tmp_str, len, copy, &no_copy, pending) == -1)
+				return -1;
+		} while (strcmp(tmp_str, "\r\n") && strcmp(tmp_str, "\n"));
+		if (valid_size)
+			valid_size = set_length(copy, head_size) == 0;
+	}
+	else if (has_length) {
+		while (size > 0) {
+			if (can_splice(valid_size, pending, size)) {
+				if (splice_body(&rio_server, client_fd, size) == -1)
+					return -1;
+				break;
+			}
+			if ((len = Rio_readnb(&rio_server, tmp_str, size > MAXBUF ? MAXBUF : size)) <= 0)
 				return -1;
-				
-			if(valid_size)
-				valid_size = append(content, tmp_str, size, &cache_size);
-				
-			if (Rio_writen(client_fd, tmp_str, len) == -1)
+			if (relay(client_fd, tmp_str, len, copy, &valid_size, pending) == -1)
 				return -1;
+			size -= len;
 		}
 	}
 	else {
-		while((len = Rio_readnb(&rio_server, tmp_str, MAXLINE)) > 0) {
-			if(valid_size)
-				valid_size = append(content, tmp_str, len, &cache_size);
-				
-			if (Rio_writen(client_fd, tmp_str, len) == -1)
+		/* delimited by the server closing the connection */
+		keep_alive = 0;
+		while (1) {
+			if (can_splice(valid_size, pending, SPLICE_ALL)) {
+				if (splice_body(&rio_server, client_fd, SPLICE_ALL) == -1)
+					return -1;
+				break;
+			}
+			if ((len = Rio_readnb(&rio_server, tmp_str, MAXLINE)) <= 0)
+				break;
+			if (relay(client_fd, tmp_str, len, copy, &valid_size, pending) == -1)
 				return -1;
 		}
 	}
 	
+	*reusable = keep_alive;
+	
 	if (valid_size) {
-		if (insert_content_node(list, cache_index, content, cache_size) == -1)
+		/* gathered straight from the chain's buffers */
+		if ((iovcnt = chain_iov(copy, iov, CHAIN_MAX_IOV)) == -1)
+			return -2;
+		if (shared_cache)
+			shm_put(shared_cache, cache_index, cache_hash(cache_index), iov, iovcnt, expires);
+		if (insert_content_iov(list, cache_index, iov, iovcnt, expires) == -1)
 			return -2;
-		printf("insert correct!\n");
 	}
 	
 	return 0;
 }
 
-int append(char *content, char *str, unsigned int len1, unsigned int *len2) {
-	if(len1 + (*len2) > MAX_OBJECT_SIZE)
+/*
+ * relay - forward len bytes to the client (unless client_fd is -1) and
+ * keep a copy while it fits the cache
+ */
+int relay(int client_fd, char *str, unsigned int len, BufChain *copy, int *valid_size, Pending *pending) {
+	if (*valid_size)
+		*valid_size = append(copy, str, len);
+	if (pending)
+		collapse_append(&collapse, pending, str, len);
+	stats_add(STAT_BYTES_IN, len);
+	if (client_fd < 0)
 		return 0;
-	
-	memcpy(content + (*len2), str, len1);
-	*len2 += len1;
-	return 1;
+	if (Rio_writen(client_fd, str, len) == -1)
+		return -1;
+	stats_add(STAT_BYTES_OUT, len);
+	return 0;
 }
 
-int parse_request(char *str, char *method, char *protocol, char *host_port, char *resource, char *version){
-	char url[MAXBUF];
+/* splice_body - splice_relay, counted like relay */
+int splice_body(rio_t *rio_server, int client_fd, unsigned long long n) {
+	long long moved = splice_relay(rio_server, client_fd, n);
 	
-	if((!strstr(str, "/")) || !strlen(str))
+	if (moved == -1)
 		return -1;
-	
-	strcpy(resource, "/");
-	sscanf(str,"%s %s %s", method, url, version);
-	
-	if (strstr(url, "://")) 
-		sscanf(url, "%[^:]://%[^/]%s", protocol, host_port, resource);
-	else
-		sscanf(url, "%[^/]%s", host_port, resource);
-		
+	stats_add(STAT_BYTES_IN, moved);
+	stats_add(STAT_BYTES_OUT, moved);
 	return 0;
 }
 
-void get_host_and_port(char *host_port, char *host, char *port){
-	char *tmpstr = strstr(host_port,":");
-	if (tmpstr) {
-		*tmpstr = '\0';
-		strcpy(port, tmpstr + 1);
-	}
-	else
-		strcpy(port, "80");
+/*
+ * can_splice - the next more body bytes can bypass user space: the copy
+ * for the cache was given up and no collapsed follower reads them.
+ */
+int can_splice(int valid_size, Pending *pending, unsigned long long more) {
+	return splice_enabled && !valid_size && (!pending || !collapse_wanted(&collapse, pending, more));
+}
+
+/* 
+ * set_length - add "Content-Length: <body bytes>" to the end of the header
+ * of a de-chunked copy, whose header is head bytes including the blank
+ * line. Returns -1 if that no longer fits MAX_OBJECT_SIZE.
+ */
+int set_length(BufChain *copy, unsigned int head) {
+	char line[64], *content = chain_pullup(copy, head);
+	unsigned int n, at = head - 2;
 	
-	strcpy(host, host_port);
+	if (head < 2 || !content || strncmp(content + at, "\r\n", 2))
+		return -1;
+	n = sprintf(line, "Content-Length: %u\r\n", copy->len - head);
+	if (copy->len + n > MAX_OBJECT_SIZE)
+		return -1;
+	return chain_insert(copy, at, line, n);
+}
+
+/* append - add len bytes to the copy; once it would outgrow MAX_OBJECT_SIZE, drop it and return 0 */
+int append(BufChain *copy, char *str, unsigned int len) {
+	if (copy->len + len > MAX_OBJECT_SIZE) {
+		chain_free(copy);
+		return 0;
+	}
+	chain_append(copy, str, len);
+	return 1;
 }
 
 void close_fd(int *client_fd, int *server_fd) {
@@ -0,0 +1,15 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "cache.h"
+#include "csapp.h"
+#include "dnscache.h"
+#include "http.h"
+#include "shmcache.h"
+
+extern CacheList *list;
+extern const char *fail_str;
+extern DnsCache dns;
+extern ShmCache *shared_cache;
+
+#endif
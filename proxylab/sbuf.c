@@ -0,0 +1,91 @@
+#include "sbuf.h"
+
+static unsigned long long elapsed_us(struct timeval *from) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - from->tv_sec) * 1000000ULL + now.tv_usec - from->tv_usec;
+}
+
+void sbuf_init(Sbuf *sp, int n, int overflow) {
+	memset(sp, 0, sizeof(*sp));
+	sp->buf = Calloc(n, sizeof(SbufItem));
+	sp->n = n;
+	sp->front = sp->rear = 0;
+	sp->overflow = overflow;
+	Sem_init(&sp->mutex, 0, 1);
+	Sem_init(&sp->slots, 0, n);
+	Sem_init(&sp->items, 0, 0);
+}
+
+void sbuf_deinit(Sbuf *sp) {
+	free(sp->buf);
+}
+
+/*
+ * sbuf_insert - queue an accepted fd for the workers.
+ * Returns 0 on success and -1 if the queue is full in SBUF_REJECT mode.
+ */
+int sbuf_insert(Sbuf *sp, int fd) {
+	if (sp->overflow == SBUF_REJECT) {
+		if (sem_trywait(&sp->slots) < 0) {
+			P(&sp->mutex);
+			sp->rejected++;
+			V(&sp->mutex);
+			return -1;
+		}
+	}
+	else
+		P(&sp->slots);
+
+	P(&sp->mutex);
+	sp->rear = (sp->rear + 1) % sp->n;
+	sp->buf[sp->rear].fd = fd;
+	gettimeofday(&sp->buf[sp->rear].enqueued, NULL);
+	sp->accepted++;
+	V(&sp->mutex);
+	V(&sp->items);
+	return 0;
+}
+
+/* sbuf_remove - take the next fd; the caller counts as busy until sbuf_done */
+int sbuf_remove(Sbuf *sp) {
+	unsigned long long wait;
+	int fd;
+
+	P(&sp->items);
+	P(&sp->mutex);
+	sp->front = (sp->front + 1) % sp->n;
+	fd = sp->buf[sp->front].fd;
+	wait = elapsed_us(&sp->buf[sp->front].enqueued);
+	sp->wait_us += wait;
+	if (wait > sp->max_wait_us)
+		sp->max_wait_us = wait;
+	sp->busy++;
+	V(&sp->mutex);
+	V(&sp->slots);
+	return fd;
+}
+
+void sbuf_done(Sbuf *sp) {
+	P(&sp->mutex);
+	sp->busy--;
+	V(&sp->mutex);
+}
+
+/* sbuf_stats - print pool occupancy and queue waits into buf */
+int sbuf_stats(Sbuf *sp, char *buf, unsigned int size) {
+	int queued, len;
+	unsigned long served;
+
+	P(&sp->mutex);
+	sem_getvalue(&sp->items, &queued);
+	served = sp->accepted - queued;
+	len = snprintf(buf, size,
+		"workers: %d\nbusy: %d\nqueued: %d/%d\naccepted: %lu\nrejected: %lu\n"
+		"avg_wait_us: %llu\nmax_wait_us: %llu\n",
+		sp->workers, sp->busy, queued, sp->n, sp->accepted, sp->rejected,
+		served ? sp->wait_us / served : 0, sp->max_wait_us);
+	V(&sp->mutex);
+	return len;
+}
@@ -0,0 +1,41 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* what sbuf_insert does when every slot is taken */
+#define SBUF_BLOCK 0	/* wait for a free slot (back-pressure on accept) */
+#define SBUF_REJECT 1	/* fail at once; the caller turns the client away */
+
+typedef struct SbufItem {
+	int fd;
+	struct timeval enqueued;
+} SbufItem;
+
+typedef struct Sbuf {
+	SbufItem *buf;
+	int n;				/* number of slots */
+	int front;			/* buf[(front+1)%n] is the first item */
+	int rear;			/* buf[rear%n] is the last item */
+	int overflow;		/* SBUF_BLOCK or SBUF_REJECT */
+	sem_t mutex;		/* protects buf, front, rear and the stats */
+	sem_t slots;
+	sem_t items;
+
+	/* stats */
+	int workers;
+	int busy;			/* workers currently serving a client */
+	unsigned long accepted;
+	unsigned long rejected;
+	unsigned long long wait_us;		/* total time fds spent queued */
+	unsigned long long max_wait_us;
+} Sbuf;
+
+void sbuf_init(Sbuf *sp, int n, int overflow);
+void sbuf_deinit(Sbuf *sp);
+int sbuf_insert(Sbuf *sp, int fd);
+int sbuf_remove(Sbuf *sp);
+void sbuf_done(Sbuf *sp);
+int sbuf_stats(Sbuf *sp, char *buf, unsigned int size);
+
+#endif
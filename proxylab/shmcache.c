@@ -0,0 +1,160 @@
+/*
+ * shmcache.c - cache tier shared by the worker processes of --processes.
+ *
+ * Each process keeps its own memory cache in front; on a miss it looks
+ * here before going to the origin, and everything it fetches and caches
+ * is also put here, so one process's fetch serves all of them. The arena
+ * is a ring: a new record overwrites the oldest bytes, and an index entry
+ * whose record has been overwritten is simply a miss. The index is
+ * set-associative (SHM_WAYS entries per set, the oldest replaced).
+ */
+#include "shmcache.h"
+
+/* record layout: ShmRec, the key with its NUL, the data, padded to 8 bytes */
+typedef struct {
+	unsigned long long hash;
+	long long expires;
+	unsigned int key_len;
+	unsigned int data_len;
+} ShmRec;
+
+#define REC_SIZE(key_len, data_len) ((sizeof(ShmRec) + (key_len) + (data_len) + 7) & ~7ULL)
+
+static void shm_lock(ShmCache *sc);
+static int intact(ShmCache *sc, unsigned long long pos);
+
+ShmCache *shm_create(unsigned long long size) {
+	unsigned int nentries = SHM_WAYS;
+	unsigned long long header;
+	pthread_mutexattr_t attr;
+	ShmCache *sc;
+	char *map;
+
+	/* room for an average object of 2 KB */
+	while (nentries < size / 2048)
+		nentries <<= 1;
+	header = (sizeof(ShmCache) + 63) & ~63ULL;
+	map = mmap(NULL, header + nentries * sizeof(ShmEntry) + size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	sc = (ShmCache *)map;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&sc->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	sc->head = 8;
+	sc->size = size;
+	sc->nentries = nentries;
+	sc->entries = (ShmEntry *)(map + header);
+	sc->arena = map + header + nentries * sizeof(ShmEntry);
+	return sc;
+}
+
+/* shm_lock - a process that died in shm_put left at most an unindexed record */
+static void shm_lock(ShmCache *sc) {
+	if (pthread_mutex_lock(&sc->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&sc->lock);
+}
+
+/* intact - no writer has reserved the arena bytes of the record at pos again */
+static int intact(ShmCache *sc, unsigned long long pos) {
+	return __atomic_load_n(&sc->head, __ATOMIC_ACQUIRE) <= pos + sc->size;
+}
+
+/*
+ * shm_get - copy the object stored for index into buf. Returns its length
+ * and sets *expires, or returns -1 on a miss or if it exceeds size.
+ */
+int shm_get(ShmCache *sc, char *index, unsigned long long hash, char *buf, unsigned int size, time_t *expires) {
+	ShmEntry *set = &sc->entries[hash & (sc->nentries - 1) & ~(SHM_WAYS - 1)];
+	unsigned int key_len = strlen(index) + 1, len, i;
+	unsigned long long pos;
+	ShmRec *rec;
+
+	for (i = 0; i < SHM_WAYS; i++) {
+		if (__atomic_load_n(&set[i].hash, __ATOMIC_RELAXED) != hash)
+			continue;
+		if (!(pos = __atomic_load_n(&set[i].pos, __ATOMIC_ACQUIRE)) || !intact(sc, pos))
+			continue;
+		/* fields may change under us; anything read is checked with intact() after */
+		rec = (ShmRec *)(sc->arena + pos % sc->size);
+		len = rec->data_len;
+		if (rec->hash != hash || rec->key_len != key_len || len > size ||
+				pos % sc->size + REC_SIZE(key_len, len) > sc->size ||
+				memcmp(rec + 1, index, key_len))
+			continue;
+		memcpy(buf, (char *)(rec + 1) + key_len, len);
+		*expires = rec->expires;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!intact(sc, pos)) {
+			__atomic_add_fetch(&sc->overwritten, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		__atomic_add_fetch(&sc->hits, 1, __ATOMIC_RELAXED);
+		return len;
+	}
+	__atomic_add_fetch(&sc->misses, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+/*
+ * shm_put - append the object gathered from iov[0..iovcnt) and index it;
+ * objects over a quarter of the arena are skipped.
+ */
+void shm_put(ShmCache *sc, char *index, unsigned long long hash, const struct iovec *iov, int iovcnt, time_t expires) {
+	ShmEntry *set = &sc->entries[hash & (sc->nentries - 1) & ~(SHM_WAYS - 1)], *e = &set[0];
+	unsigned int key_len = strlen(index) + 1, len = 0, off, i;
+	unsigned long long rec_size, pos;
+	ShmRec *rec;
+
+	for (i = 0; i < (unsigned int)iovcnt; i++)
+		len += iov[i].iov_len;
+	rec_size = REC_SIZE(key_len, len);
+
+	if (rec_size > sc->size / 4)
+		return;
+	shm_lock(sc);
+	/* records never wrap: skip the tail of the arena if this one does not fit */
+	pos = sc->head;
+	if (pos % sc->size + rec_size > sc->size)
+		pos += sc->size - pos % sc->size;
+	/* reserve before writing, so readers of the bytes about to change see it */
+	__atomic_store_n(&sc->head, pos + rec_size, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec = (ShmRec *)(sc->arena + pos % sc->size);
+	rec->hash = hash;
+	rec->expires = expires;
+	rec->key_len = key_len;
+	rec->data_len = len;
+	memcpy(rec + 1, index, key_len);
+	for (i = 0, off = key_len; i < (unsigned int)iovcnt; off += iov[i].iov_len, i++)
+		memcpy((char *)(rec + 1) + off, iov[i].iov_base, iov[i].iov_len);
+
+	/* the same key's entry, else an empty one, else the oldest */
+	for (i = 0; i < SHM_WAYS; i++) {
+		if (set[i].hash == hash || !set[i].pos) {
+			e = &set[i];
+			break;
+		}
+		if (set[i].pos < e->pos)
+			e = &set[i];
+	}
+	__atomic_store_n(&e->hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->pos, pos, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sc->lock);
+	__atomic_add_fetch(&sc->puts, 1, __ATOMIC_RELAXED);
+}
+
+int shm_stats(ShmCache *sc, char *buf, unsigned int size) {
+	unsigned long long head = __atomic_load_n(&sc->head, __ATOMIC_RELAXED);
+
+	return snprintf(buf, size,
+		"shared_hits: %lu\nshared_misses: %lu\nshared_puts: %lu\nshared_overwritten: %lu\nshared_bytes: %llu\n",
+		__atomic_load_n(&sc->hits, __ATOMIC_RELAXED), __atomic_load_n(&sc->misses, __ATOMIC_RELAXED),
+		__atomic_load_n(&sc->puts, __ATOMIC_RELAXED), __atomic_load_n(&sc->overwritten, __ATOMIC_RELAXED),
+		head < sc->size ? head : sc->size);
+}
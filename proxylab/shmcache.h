@@ -0,0 +1,45 @@
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include <sys/uio.h>
+#include <time.h>
+
+#include "csapp.h"
+
+#define DEFAULT_SHM_SIZE 256		/* MB */
+#define SHM_WAYS 4					/* index entries a key may occupy */
+
+/* where one object's record starts in the arena; pos 0 is never used */
+typedef struct ShmEntry {
+	unsigned long long hash;
+	unsigned long long pos;
+} ShmEntry;
+
+/*
+ * A cache tier in one anonymous shared mapping, set up before the worker
+ * processes fork so all of them see it: this header, the index and an
+ * arena that records are appended to as a ring. Writers serialize on a
+ * process-shared mutex; readers take no lock and instead check, after
+ * copying a record out, that no writer has reserved its bytes since.
+ */
+typedef struct ShmCache {
+	pthread_mutex_t lock;			/* writers only; robust against a dying process */
+	unsigned long long head;		/* ring position of the next record; starts at 8 */
+	unsigned long long size;		/* arena bytes */
+	unsigned int nentries;			/* a power of 2 */
+	ShmEntry *entries;				/* addresses are the same in every process */
+	char *arena;
+
+	/* stats, summed over all processes */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long puts;
+	unsigned long overwritten;		/* found in the index but already reused */
+} ShmCache;
+
+ShmCache *shm_create(unsigned long long size);
+int shm_get(ShmCache *sc, char *index, unsigned long long hash, char *buf, unsigned int size, time_t *expires);
+void shm_put(ShmCache *sc, char *index, unsigned long long hash, const struct iovec *iov, int iovcnt, time_t expires);
+int shm_stats(ShmCache *sc, char *buf, unsigned int size);
+
+#endif
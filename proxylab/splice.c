@@ -0,0 +1,102 @@
+/*
+ * splice.c - zero-copy relay for response bodies the proxy does not keep.
+ * Bytes rio already read ahead are written out first; the rest moves
+ * socket -> pipe -> socket with splice(2) and never enters user space.
+ * Every thread keeps one pipe for its lifetime.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+
+#include "splice.h"
+
+int splice_enabled = 1;	/* --splice=off relays through rio instead */
+
+static __thread int pipefd[2] = {-1, -1};
+
+/* stats */
+static unsigned long relays;
+static unsigned long long relayed;
+
+static int thread_pipe(void);
+static void drop_pipe(void);
+
+static int thread_pipe(void) {
+	if (pipefd[0] >= 0)
+		return 0;
+	if (pipe2(pipefd, O_CLOEXEC) < 0)
+		return -1;
+	/* fewer round trips per MB; a failure just keeps the default 64 KB */
+	fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	return 0;
+}
+
+/* drop_pipe - a failed relay may leave bytes in the pipe; never reuse it */
+static void drop_pipe(void) {
+	close(pipefd[0]);
+	close(pipefd[1]);
+	pipefd[0] = pipefd[1] = -1;
+}
+
+/*
+ * splice_relay - move n bytes, or with SPLICE_ALL everything up to EOF,
+ * from rp's descriptor to out_fd. Exactly n bytes are consumed, so rp can
+ * be read again afterwards. Returns the bytes moved, or -1 on an error or
+ * if the server closed before n bytes.
+ */
+long long splice_relay(rio_t *rp, int out_fd, unsigned long long n) {
+	unsigned long long total = 0, want;
+	int until_eof = (n == SPLICE_ALL);
+	ssize_t in, out;
+	unsigned int cnt;
+
+	if (rp->rio_cnt > 0) {
+		cnt = (unsigned long long)rp->rio_cnt < n ? rp->rio_cnt : n;
+		if (rio_writen(out_fd, rp->rio_bufptr, cnt) != cnt)
+			return -1;
+		rp->rio_bufptr += cnt;
+		rp->rio_cnt -= cnt;
+		total += cnt;
+		if (!until_eof)
+			n -= cnt;
+	}
+	if (!n)
+		goto done;
+	if (thread_pipe() == -1)
+		return -1;
+
+	while (n > 0) {
+		want = n < SPLICE_PIPE_SIZE ? n : SPLICE_PIPE_SIZE;
+		if ((in = splice(rp->rio_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (in == 0) {
+			if (until_eof)
+				break;
+			return -1;
+		}
+		total += in;
+		if (!until_eof)
+			n -= in;
+		while (in > 0) {
+			if ((out = splice(pipefd[0], NULL, out_fd, NULL, in, SPLICE_F_MOVE)) < 0 && errno == EINTR)
+				continue;
+			if (out <= 0) {
+				drop_pipe();
+				return -1;
+			}
+			in -= out;
+		}
+	}
+
+done:
+	__atomic_add_fetch(&relays, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&relayed, total, __ATOMIC_RELAXED);
+	return total;
+}
+
+int splice_stats(char *buf, unsigned int size) {
+	return snprintf(buf, size, "splice_relays: %lu\nsplice_bytes: %llu\n",
+		__atomic_load_n(&relays, __ATOMIC_RELAXED), __atomic_load_n(&relayed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,14 @@
+#ifndef __SPLICE_H__
+#define __SPLICE_H__
+
+#include "csapp.h"
+
+#define SPLICE_ALL (~0ULL)			/* relay until the server closes */
+#define SPLICE_PIPE_SIZE (1 << 20)	/* requested size of each thread's pipe */
+
+extern int splice_enabled;
+
+long long splice_relay(rio_t *rp, int out_fd, unsigned long long n);
+int splice_stats(char *buf, unsigned int size);
+
+#endif
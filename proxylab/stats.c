@@ -0,0 +1,194 @@
+/*
+ * stats.c - request counters and latency histograms, served on /__stats.
+ *
+ * Counters and histograms are kept per thread (see StatsSlot) so the
+ * request path never shares a cache line or takes a lock to count. The
+ * histograms are HDR-style: bucket width grows with the value, so every
+ * recorded time is kept to within 1/HIST_SUB of itself from nanoseconds
+ * to minutes in a fixed 2.4 KB per histogram.
+ */
+#include <stdarg.h>
+
+#include "stats.h"
+#include "procs.h"
+
+static const char *counter_names[STAT_COUNTERS] = {
+	"requests", "hits", "disk_hits", "shared_hits", "revalidated", "collapsed", "misses", "errors",
+	"bytes_in", "bytes_out", "bytes_hit", "connections_opened", "connections_closed"
+};
+static const char *timer_names[STAT_TIMERS] = {"total", "lookup", "connect", "ttfb"};
+static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char *percentile_names[] = {"p50", "p90", "p99", "p999"};
+
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static StatsSlot *slots;
+static __thread StatsSlot *slot;
+
+static StatsSlot *my_slot(void);
+static unsigned int bucket_of(unsigned long long v);
+static unsigned long long bucket_value(unsigned int i);
+static unsigned long long percentile(Histogram *h, double q);
+static void emit(char *buf, unsigned int size, int *len, const char *fmt, ...);
+
+/* relaxed load and store: the owning thread is the only writer */
+#define BUMP(field, n) \
+	__atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+static StatsSlot *my_slot(void) {
+	if (!slot) {
+		slot = Calloc(1, sizeof(StatsSlot));
+		pthread_mutex_lock(&slots_lock);
+		slot->next = slots;
+		__atomic_store_n(&slots, slot, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&slots_lock);
+	}
+	return slot;
+}
+
+unsigned long long stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_add(enum stat_counter counter, unsigned long long n) {
+	StatsSlot *s = my_slot();
+
+	BUMP(s->counters[counter], n);
+}
+
+/* stats_local - this thread's own count, for per-request differences */
+unsigned long long stats_local(enum stat_counter counter) {
+	return my_slot()->counters[counter];
+}
+
+/* bucket_of - v < HIST_SUB is its own bucket, else (exponent, top bits below the leading one) */
+static unsigned int bucket_of(unsigned long long v) {
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+	if (v >> (HIST_MAX_EXP + 1))
+		v = (1ULL << (HIST_MAX_EXP + 1)) - 1;
+	e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* bucket_value - middle of bucket i */
+static unsigned long long bucket_value(unsigned int i) {
+	int shift;
+
+	if (i < HIST_SUB)
+		return i;
+	shift = i / HIST_SUB - 1;
+	return ((unsigned long long)(HIST_SUB + i % HIST_SUB) << shift) + ((1ULL << shift) >> 1);
+}
+
+void stats_time(enum stat_timer timer, unsigned long long start) {
+	Histogram *h = &my_slot()->timers[timer];
+	unsigned long long v = stats_now() - start;
+
+	BUMP(h->buckets[bucket_of(v)], 1);
+	BUMP(h->count, 1);
+	BUMP(h->sum, v);
+	if (v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/* stats_mark - start a timer that a later stats_since_mark on this thread stops */
+void stats_mark(void) {
+	my_slot()->mark = stats_now();
+}
+
+void stats_since_mark(enum stat_timer timer) {
+	StatsSlot *s = my_slot();
+
+	if (s->mark) {
+		stats_time(timer, s->mark);
+		s->mark = 0;
+	}
+}
+
+static unsigned long long percentile(Histogram *h, double q) {
+	unsigned long long rank = q * h->count, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if ((seen += h->buckets[i]) > rank)
+			return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+	return h->max;
+}
+
+static void emit(char *buf, unsigned int size, int *len, const char *fmt, ...) {
+	va_list ap;
+
+	if ((unsigned int)*len >= size)
+		return;
+	va_start(ap, fmt);
+	*len += vsnprintf(buf + *len, size - *len, fmt, ap);
+	va_end(ap);
+	if ((unsigned int)*len >= size)
+		*len = size - 1;
+}
+
+/*
+ * stats_report - the sum over all threads of this process as "name: value"
+ * lines, or as one JSON object. Times are in microseconds.
+ */
+int stats_report(char *buf, unsigned int size, int json) {
+	unsigned long long c[STAT_COUNTERS] = {0}, max;
+	Histogram *h = Calloc(STAT_TIMERS, sizeof(Histogram));
+	StatsSlot *s;
+	int len = 0, i, j, k;
+
+	for (s = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); s; s = s->next) {
+		for (i = 0; i < STAT_COUNTERS; i++)
+			c[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+		for (i = 0; i < STAT_TIMERS; i++) {
+			h[i].count += __atomic_load_n(&s->timers[i].count, __ATOMIC_RELAXED);
+			h[i].sum += __atomic_load_n(&s->timers[i].sum, __ATOMIC_RELAXED);
+			if ((max = __atomic_load_n(&s->timers[i].max, __ATOMIC_RELAXED)) > h[i].max)
+				h[i].max = max;
+			for (j = 0; j < HIST_BUCKETS; j++)
+				h[i].buckets[j] += __atomic_load_n(&s->timers[i].buckets[j], __ATOMIC_RELAXED);
+		}
+	}
+
+	emit(buf, size, &len, json ? "{" : "");
+	for (i = 0; i < STAT_COUNTERS; i++)
+		emit(buf, size, &len, json ? "\"%s\": %llu, " : "%s: %llu\n", counter_names[i], c[i]);
+	emit(buf, size, &len, json ? "\"connections_active\": %llu, " : "connections_active: %llu\n",
+		c[STAT_CONN_OPENED] - c[STAT_CONN_CLOSED]);
+	emit(buf, size, &len, json ? "\"hit_ratio\": %.4f, " : "hit_ratio: %.4f\n", c[STAT_REQUESTS] ?
+		(double)(c[STAT_HITS] + c[STAT_DISK_HITS] + c[STAT_SHARED_HITS] + c[STAT_REVALIDATED]) /
+		c[STAT_REQUESTS] : 0.0);
+	emit(buf, size, &len, json ? "\"byte_hit_ratio\": %.4f, " : "byte_hit_ratio: %.4f\n",
+		c[STAT_BYTES_OUT] ? (double)c[STAT_BYTES_HIT] / c[STAT_BYTES_OUT] : 0.0);
+
+	emit(buf, size, &len, json ? "\"latency_us\": {" : "");
+	for (i = 0; i < STAT_TIMERS; i++) {
+		emit(buf, size, &len, json ? "%s\"%s\": {\"count\": %lu, \"mean\": %.1f" :
+			"%slatency_%s_us: count %lu mean %.1f", json && i ? ", " : "", timer_names[i],
+			h[i].count, h[i].count ? h[i].sum / 1000.0 / h[i].count : 0.0);
+		for (k = 0; k < sizeof(percentiles) / sizeof(percentiles[0]); k++)
+			emit(buf, size, &len, json ? ", \"%s\": %.1f" : " %s %.1f", percentile_names[k],
+				percentile(&h[i], percentiles[k]) / 1000.0);
+		emit(buf, size, &len, json ? ", \"max\": %.1f}" : " max %.1f\n", h[i].max / 1000.0);
+	}
+	emit(buf, size, &len, json ? "}" : "");
+	/* the only cross-process numbers: every worker's load */
+	len += procs_report(buf + len, size - len, json);
+	emit(buf, size, &len, json ? "}\n" : "");
+	free(h);
+	return len;
+}
+
+/* stats_page - the whole HTTP response for STATS_PATH */
+int stats_page(char *buf, unsigned int size, int json, const char *connection) {
+	char body[MAXBUF];
+	int len = stats_report(body, sizeof(body), json);
+
+	return snprintf(buf, size, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\n%s\r\n%s",
+		json ? "application/json" : "text/plain", len, connection, body);
+}
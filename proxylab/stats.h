@@ -0,0 +1,68 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+#define STATS_PATH "/__stats"	/* "?format=json" for JSON */
+
+/* log-linear latency buckets: values below 2^HIST_SUB_BITS are exact,
+   above that every power of two is split into 2^HIST_SUB_BITS buckets */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40			/* ns; longer times count as about 18 minutes */
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+enum stat_counter {
+	STAT_REQUESTS,			/* proxied GETs */
+	STAT_HITS,				/* served fresh from memory */
+	STAT_DISK_HITS,
+	STAT_SHARED_HITS,		/* from the tier shared by --processes workers */
+	STAT_REVALIDATED,		/* stale, served after a 304 */
+	STAT_COLLAPSED,			/* streamed from another request's fetch */
+	STAT_MISSES,			/* fetched in full from the origin */
+	STAT_ERRORS,
+	STAT_BYTES_IN,			/* response bytes read from origins */
+	STAT_BYTES_OUT,			/* response bytes written to clients */
+	STAT_BYTES_HIT,			/* of those, from the memory or disk cache */
+	STAT_CONN_OPENED,		/* client connections */
+	STAT_CONN_CLOSED,
+	STAT_COUNTERS
+};
+
+enum stat_timer {
+	TIMER_TOTAL,			/* request parsed to response written */
+	TIMER_LOOKUP,			/* memory and disk cache lookup */
+	TIMER_CONNECT,			/* opening a new upstream connection */
+	TIMER_TTFB,				/* request sent upstream to first response byte */
+	STAT_TIMERS
+};
+
+typedef struct Histogram {
+	unsigned long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned int buckets[HIST_BUCKETS];
+} Histogram;
+
+/*
+ * Every thread owns one slot and is its only writer, so updates are plain
+ * relaxed stores with no lock or atomic read-modify-write. A report sums
+ * all slots; slots live as long as the process.
+ */
+typedef struct StatsSlot {
+	unsigned long long counters[STAT_COUNTERS];
+	Histogram timers[STAT_TIMERS];
+	unsigned long long mark;	/* stats_mark time, 0 if none */
+	struct StatsSlot *next;
+} StatsSlot;
+
+unsigned long long stats_now(void);
+void stats_add(enum stat_counter counter, unsigned long long n);
+unsigned long long stats_local(enum stat_counter counter);
+void stats_time(enum stat_timer timer, unsigned long long start);
+void stats_mark(void);
+void stats_since_mark(enum stat_timer timer);
+int stats_report(char *buf, unsigned int size, int json);
+int stats_page(char *buf, unsigned int size, int json, const char *connection);
+
+#endif